@@ -0,0 +1,438 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks do RSFS. Cada teste mede o tempo de cada operacao e
+ * relata operacoes/s, MB/s e as latencias p50 e p99; os resultados vao para
+ * um arquivo CSV ou JSON, para comparar versoes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "disk.h"
+#include "fs.h"
+
+#define MAX_RESULTADOS 32
+#define MAX_NOME 32
+#define ARQUIVOS_CHURN 100
+#define LEITURAS_ALEATORIAS 4096
+#define MONTAGENS 20
+#define CRC_BUFFER (1024 * 1024)
+#define CRC_PASSADAS 256
+
+typedef struct {
+  char nome[MAX_NOME];
+  long ops;
+  long long bytes;
+  double segundos;
+  double p50;                 /* Latencias em microssegundos */
+  double p99;
+} resultado;
+
+char *imagem;
+int tamanho;                  /* Tamanho da imagem em setores */
+int backend;
+int agrup;                    /* Tamanho do agrupamento na formatacao */
+resultado resultados[MAX_RESULTADOS];
+int num_resultados;
+char *sufixo = "";            /* Acrescentado aos nomes dos testes de E/S */
+
+/* Latencias da medicao em andamento */
+double *latencias;
+long num_latencias;
+long cap_latencias;
+struct timespec inicio_medida;
+
+static double agora() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void medida_inicia() {
+  num_latencias = 0;
+  clock_gettime(CLOCK_MONOTONIC, &inicio_medida);
+}
+
+static void latencia(double inicio) {
+  if (num_latencias == cap_latencias) {
+    cap_latencias = cap_latencias ? cap_latencias * 2 : 1024;
+    latencias = realloc(latencias, cap_latencias * sizeof(double));
+    if (latencias == NULL) {
+      perror("Alocando latencias");
+      exit(1);
+    }
+  }
+  latencias[num_latencias++] = (agora() - inicio) * 1e6;
+}
+
+static int compara_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentil(double p) {
+  long i = (long) (p * (num_latencias - 1) + 0.5);
+
+  return num_latencias > 0 ? latencias[i] : 0;
+}
+
+/* Fecha a medicao em andamento e guarda o resultado */
+static void medida_conclui(char *nome, long long bytes) {
+  struct timespec fim;
+  resultado *r;
+
+  clock_gettime(CLOCK_MONOTONIC, &fim);
+  if (num_resultados == MAX_RESULTADOS) {
+    return;
+  }
+  r = &resultados[num_resultados++];
+  snprintf(r->nome, MAX_NOME, "%s", nome);
+  r->ops = num_latencias;
+  r->bytes = bytes;
+  r->segundos = (fim.tv_sec - inicio_medida.tv_sec) +
+                (fim.tv_nsec - inicio_medida.tv_nsec) / 1e9;
+  qsort(latencias, num_latencias, sizeof(double), compara_double);
+  r->p50 = percentil(0.50);
+  r->p99 = percentil(0.99);
+  fprintf(stderr, "%-20s %8ld ops %10.0f ops/s %9.2f MB/s  p50 %8.1f us  p99 %8.1f us\n",
+          r->nome, r->ops, r->ops / r->segundos,
+          r->bytes / r->segundos / (1024 * 1024), r->p50, r->p99);
+}
+
+/* Recria e formata a imagem, para cada teste partir do disco vazio. A
+ * imagem recem-criada nao tem superbloco, entao nao ha o que montar antes
+ * da formatacao. */
+static void prepara_disco() {
+  unlink(imagem);
+  if (!bl_init_backend(imagem, tamanho, backend) ||
+      !fs_format_cluster(agrup)) {
+    fprintf(stderr, "Erro preparando a imagem %s\n", imagem);
+    exit(1);
+  }
+}
+
+static void bench_churn(int rodadas) {
+  char nome[MAX_NOME];
+
+  prepara_disco();
+  medida_inicia();
+  for (int r = 0; r < rodadas; r++) {
+    for (int i = 0; i < ARQUIVOS_CHURN; i++) {
+      double t = agora();
+
+      sprintf(nome, "churn%d", i);
+      fs_create(nome);
+      latencia(t);
+    }
+    for (int i = 0; i < ARQUIVOS_CHURN; i++) {
+      double t = agora();
+
+      sprintf(nome, "churn%d", i);
+      fs_remove(nome);
+      latencia(t);
+    }
+  }
+  fs_sync();
+  medida_conclui("create_remove", 0);
+}
+
+/* Escreve total bytes em buffers de tam bytes no arquivo nome */
+static void bench_escrita(char *nome, long long total, int tam) {
+  char rotulo[MAX_NOME];
+  char *buffer = malloc(tam);
+  long long feito = 0;
+  int f;
+
+  memset(buffer, 'x', tam);
+  medida_inicia();
+  f = fs_open(nome, FS_W);
+  while (f != -1 && feito < total) {
+    double t = agora();
+
+    if (fs_write(buffer, tam, f) != tam) {
+      break;
+    }
+    latencia(t);
+    feito += tam;
+  }
+  fs_close(f);
+  fs_sync();
+  snprintf(rotulo, MAX_NOME, "seq_write_%d%s", tam, sufixo);
+  medida_conclui(rotulo, feito);
+  free(buffer);
+}
+
+static void bench_leitura(char *nome, int tam) {
+  char rotulo[MAX_NOME];
+  char *buffer = malloc(tam);
+  long long feito = 0;
+  int f, n;
+
+  medida_inicia();
+  f = fs_open(nome, FS_R);
+  while (f != -1) {
+    double t = agora();
+
+    n = fs_read(buffer, tam, f);
+    if (n <= 0) {
+      break;
+    }
+    latencia(t);
+    feito += n;
+  }
+  fs_close(f);
+  snprintf(rotulo, MAX_NOME, "seq_read_%d%s", tam, sufixo);
+  medida_conclui(rotulo, feito);
+  free(buffer);
+}
+
+static void bench_aleatoria(char *nome, long long total, int tam) {
+  char rotulo[MAX_NOME];
+  char *buffer = malloc(tam);
+  long long feito = 0;
+  long blocos = total / tam;
+  int f;
+
+  srand(1);
+  medida_inicia();
+  f = fs_open(nome, FS_R);
+  for (int i = 0; f != -1 && blocos > 0 && i < LEITURAS_ALEATORIAS; i++) {
+    double t = agora();
+
+    fs_seek(f, (rand() % blocos) * tam);
+    if (fs_read(buffer, tam, f) != tam) {
+      break;
+    }
+    latencia(t);
+    feito += tam;
+  }
+  fs_close(f);
+  snprintf(rotulo, MAX_NOME, "rand_read_%d%s", tam, sufixo);
+  medida_conclui(rotulo, feito);
+  free(buffer);
+}
+
+/* Escreve em blocos de 1 MB ate o disco encher */
+static void bench_enche() {
+  int tam = 1024 * 1024;
+  char *buffer = malloc(tam);
+  long long feito = 0;
+  int f;
+
+  prepara_disco();
+  memset(buffer, 'y', tam);
+  medida_inicia();
+  f = fs_open("cheio", FS_W);
+  while (f != -1) {
+    double t = agora();
+
+    if (fs_write(buffer, tam, f) != tam) {
+      break;
+    }
+    latencia(t);
+    feito += tam;
+  }
+  fs_close(f);
+  fs_sync();
+  medida_conclui("fill_to_full", feito);
+  free(buffer);
+}
+
+static void bench_montagem() {
+  medida_inicia();
+  for (int i = 0; i < MONTAGENS; i++) {
+    double t = agora();
+
+    if (!bl_init_backend(imagem, tamanho, backend) || !fs_init()) {
+      break;
+    }
+    latencia(t);
+  }
+  medida_conclui("mount", 0);
+}
+
+/* CRC32C de setores de 512 bytes, como nas somas dos dados, com a
+ * instrucao do processador ou com a versao portavel */
+static void bench_crc(int hardware) {
+  char *buffer = malloc(CRC_BUFFER);
+  volatile unsigned int soma = 0;
+
+  for (int i = 0; i < CRC_BUFFER; i++) {
+    buffer[i] = i * 7;
+  }
+  hardware = crc32c_config(hardware);
+  medida_inicia();
+  for (int p = 0; p < CRC_PASSADAS; p++) {
+    double t = agora();
+
+    for (int i = 0; i < CRC_BUFFER; i += SECTORSIZE) {
+      soma += crc32c(0, buffer + i, SECTORSIZE);
+    }
+    latencia(t);
+  }
+  medida_conclui(hardware ? "crc32c_hw" : "crc32c_sw", (long long) CRC_PASSADAS * CRC_BUFFER);
+  crc32c_config(1);
+  free(buffer);
+}
+
+static void grava_csv(FILE *saida) {
+  fprintf(saida, "benchmark,ops,segundos,ops_s,mb_s,p50_us,p99_us\n");
+  for (int i = 0; i < num_resultados; i++) {
+    resultado *r = &resultados[i];
+
+    fprintf(saida, "%s,%ld,%.6f,%.1f,%.3f,%.2f,%.2f\n", r->nome, r->ops,
+            r->segundos, r->ops / r->segundos,
+            r->bytes / r->segundos / (1024 * 1024), r->p50, r->p99);
+  }
+}
+
+static void grava_json(FILE *saida) {
+  fprintf(saida, "{\n  \"backend\": \"%s\",\n  \"imagem_mb\": %d,\n  \"agrupamento\": %d,\n",
+          backend == BL_MMAP ? "mmap" : "pread", tamanho / 2048, agrup);
+  fprintf(saida, "  \"resultados\": [\n");
+  for (int i = 0; i < num_resultados; i++) {
+    resultado *r = &resultados[i];
+
+    fprintf(saida, "    {\"benchmark\": \"%s\", \"ops\": %ld, "
+            "\"segundos\": %.6f, \"ops_s\": %.1f, \"mb_s\": %.3f, "
+            "\"p50_us\": %.2f, \"p99_us\": %.2f}%s\n", r->nome, r->ops,
+            r->segundos, r->ops / r->segundos,
+            r->bytes / r->segundos / (1024 * 1024), r->p50, r->p99,
+            i + 1 < num_resultados ? "," : "");
+  }
+  fprintf(saida, "  ]\n}\n");
+}
+
+static void uso(char *programa) {
+  printf("Uso: %s [-m] [-s tamanho] [-c agrupamento] [-t total] [-f csv|json] [-o saida] imagem\n",
+         programa);
+  printf("Onde: -m mapeia a imagem em memória.\n");
+  printf("      -s tamanho da imagem em MB (padrão 64).\n");
+  printf("      -c bytes por agrupamento na formatação (padrão %d).\n", FS_AGRUP_PADRAO);
+  printf("      -t MB escritos e lidos nos testes sequenciais (padrão 16).\n");
+  printf("      -f formato dos resultados (padrão csv).\n");
+  printf("      -o arquivo dos resultados (padrão rsfs_bench.csv ou .json).\n");
+  printf("      imagem é o arquivo de imagem usado (e apagado) pelos testes.\n");
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  int tamanhos[] = { 512, 4096, 65536, 1024 * 1024 };
+  int json = 0;
+  char *saida = NULL;
+  long long total;
+  FILE *arq;
+  int opcao;
+
+  backend = BL_PREAD;
+  agrup = FS_AGRUP_PADRAO;
+  tamanho = 64 * 2048;        /* Cada MB tem 2048 setores. */
+  total = 16 * 1024 * 1024;
+  while ((opcao = getopt(argc, argv, "ms:c:t:f:o:")) != -1) {
+    switch (opcao) {
+    case 'm':
+      backend = BL_MMAP;
+      break;
+    case 's':
+      tamanho = atoi(optarg) * 2048;
+      break;
+    case 'c':
+      agrup = atoi(optarg);
+      break;
+    case 't':
+      total = atoll(optarg) * 1024 * 1024;
+      break;
+    case 'f':
+      json = !strcmp(optarg, "json");
+      break;
+    case 'o':
+      saida = optarg;
+      break;
+    default:
+      uso(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || tamanho <= 0 || total <= 0) {
+    uso(argv[0]);
+  }
+  imagem = argv[optind];
+  if (saida == NULL) {
+    saida = json ? "rsfs_bench.json" : "rsfs_bench.csv";
+  }
+
+  bench_churn(10);
+  for (int i = 0; i < 4; i++) {
+    prepara_disco();
+    bench_escrita("seq", total, tamanhos[i]);
+    bench_leitura("seq", tamanhos[i]);
+    if (tamanhos[i] == 4096) {
+      bench_aleatoria("seq", total, tamanhos[i]);
+    }
+  }
+  bench_enche();
+  bench_montagem();
+  fs_sync();
+
+  /* Custo das somas de verificacao: os mesmos testes num disco formatado
+   * com elas, a leitura de novo depois de remontar (quando cada setor tem
+   * a soma conferida) e o calculo sozinho */
+  fs_somas_config(1);
+  for (int i = 1; i < 4; i += 2) {
+    sufixo = "_somas";
+    prepara_disco();
+    bench_escrita("seq", total, tamanhos[i]);
+    bench_leitura("seq", tamanhos[i]);
+    if (tamanhos[i] == 4096) {
+      bench_aleatoria("seq", total, tamanhos[i]);
+    }
+    sufixo = "_somas_montado";
+    if (!bl_init_backend(imagem, 0, backend) || fs_init() != FS_MONTADO) {
+      fprintf(stderr, "Erro remontando a imagem %s\n", imagem);
+      exit(1);
+    }
+    bench_leitura("seq", tamanhos[i]);
+  }
+  fs_sync();
+  fs_somas_config(0);
+  bench_crc(1);
+  bench_crc(0);
+
+  arq = fopen(saida, "w");
+  if (arq == NULL) {
+    perror("Criando arquivo de resultados");
+    return 1;
+  }
+  if (json) {
+    grava_json(arq);
+  } else {
+    grava_csv(arq);
+  }
+  fclose(arq);
+  fprintf(stderr, "Resultados gravados em %s\n", saida);
+  return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_HARDWARE
+#endif
+
+/* CRC-32C (Castagnoli), polinomio refletido */
+#define CRC32C_POLI 0x82F63B78u
+
+/* Bytes de cada um dos tres fluxos calculados em paralelo pela instrucao
+ * crc32, que tem latencia de tres ciclos mas aceita uma por ciclo */
+#define FLUXO 168
+
+/* tabela[k][b]: registrador b depois de k + 1 bytes (slicing-by-8) */
+static unsigned int tabela[8][256];
+/* avanco[k][b]: registrador b << 8k depois de FLUXO bytes zero, para emendar
+ * os fluxos */
+static unsigned int avanco[4][256];
+static pthread_once_t tabelas_prontas = PTHREAD_ONCE_INIT;
+static int hardware;
+
+static void monta_tabelas() {
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned int c = i;
+
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLI : c >> 1;
+    }
+    tabela[0][i] = c;
+  }
+  for (int k = 1; k < 8; k++) {
+    for (int i = 0; i < 256; i++) {
+      tabela[k][i] = (tabela[k - 1][i] >> 8) ^ tabela[0][tabela[k - 1][i] & 0xFF];
+    }
+  }
+  /* O registrador evolui linearmente sobre bytes zero: basta avancar cada
+   * byte dele isoladamente */
+  for (int k = 0; k < 4; k++) {
+    for (unsigned int i = 0; i < 256; i++) {
+      unsigned int c = i << (8 * k);
+
+      for (int n = 0; n < FLUXO; n++) {
+        c = tabela[0][c & 0xFF] ^ (c >> 8);
+      }
+      avanco[k][i] = c;
+    }
+  }
+#ifdef CRC_HARDWARE
+  __builtin_cpu_init();
+  hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* Versao portavel, oito bytes por passo */
+static unsigned int crc_software(unsigned int crc, const unsigned char *p, int n) {
+  while (n >= 8) {
+    unsigned int a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+    unsigned int b = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+
+    crc = tabela[7][a & 0xFF] ^ tabela[6][(a >> 8) & 0xFF] ^
+          tabela[5][(a >> 16) & 0xFF] ^ tabela[4][a >> 24] ^
+          tabela[3][b & 0xFF] ^ tabela[2][(b >> 8) & 0xFF] ^
+          tabela[1][(b >> 16) & 0xFF] ^ tabela[0][b >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while (n-- > 0) {
+    crc = tabela[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef CRC_HARDWARE
+static unsigned int avanca(unsigned int crc) {
+  return avanco[0][crc & 0xFF] ^ avanco[1][(crc >> 8) & 0xFF] ^
+         avanco[2][(crc >> 16) & 0xFF] ^ avanco[3][crc >> 24];
+}
+
+/* Palavra de 8 bytes em qualquer alinhamento */
+typedef uint64_t palavra __attribute__((may_alias, aligned(1)));
+
+/* Versao com a instrucao crc32 (SSE4.2). Os blocos de 3 * FLUXO bytes vao
+ * em tres fluxos independentes, emendados no fim: o registrador depois de
+ * a seguido de b e o de a avancado |b| bytes zero, xor o de b a partir de 0. */
+__attribute__((target("sse4.2")))
+static unsigned int crc_hardware(unsigned int crc, const unsigned char *p, int n) {
+  uint64_t c0 = crc;
+
+  while (n >= 3 * FLUXO) {
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+
+    for (int i = 0; i < FLUXO; i += 8) {
+      c0 = _mm_crc32_u64(c0, *(const palavra *) (p + i));
+      c1 = _mm_crc32_u64(c1, *(const palavra *) (p + FLUXO + i));
+      c2 = _mm_crc32_u64(c2, *(const palavra *) (p + 2 * FLUXO + i));
+    }
+    c0 = avanca(avanca(c0) ^ c1) ^ c2;
+    p += 3 * FLUXO;
+    n -= 3 * FLUXO;
+  }
+  while (n >= 8) {
+    c0 = _mm_crc32_u64(c0, *(const palavra *) p);
+    p += 8;
+    n -= 8;
+  }
+  while (n-- > 0) {
+    c0 = _mm_crc32_u8(c0, *p++);
+  }
+  return c0;
+}
+#endif
+
+int crc32c_config(int usar_hardware) {
+  pthread_once(&tabelas_prontas, monta_tabelas);
+#ifdef CRC_HARDWARE
+  hardware = usar_hardware && __builtin_cpu_supports("sse4.2");
+#endif
+  return hardware;
+}
+
+/* Continua o CRC de um trecho anterior (0 para comecar): o CRC de a seguido
+ * de b e crc32c(crc32c(0, a), b). */
+unsigned int crc32c(unsigned int crc, const void *dados, int tamanho) {
+  pthread_once(&tabelas_prontas, monta_tabelas);
+#ifdef CRC_HARDWARE
+  if (hardware) {
+    return ~crc_hardware(~crc, dados, tamanho);
+  }
+#endif
+  return ~crc_software(~crc, dados, tamanho);
+}
@@ -20,76 +20,1144 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
 #include "disk.h"
 
 #define PAGESIZE 4096
 
-int device_size;
-FILE *stream;
+/* Maximo de segmentos agrupados em uma unica chamada preadv/pwritev */
+#define MAX_IOV 64
+
+off_t device_size;          /* Em bytes; imagens podem passar de 2 GB */
+int device_fd = -1;
+char *device_map;             /* Imagem mapeada em memoria (backend BL_MMAP) */
+
+/* Cache de setores (LRU, write-back) */
+
+typedef struct bl_buffer {
+  int sector;                 /* -1 se o buffer estiver livre */
+  char sujo;
+  struct bl_buffer *ant;      /* Lista LRU: cabeca e o mais recente */
+  struct bl_buffer *prox;
+  struct bl_buffer *hash;     /* Proximo buffer no mesmo balde */
+  char dados[SECTORSIZE];
+} bl_buffer;
+
+bl_buffer *cache_buffers;
+bl_buffer **cache_baldes;
+bl_buffer cache_lru;          /* Sentinela da lista LRU */
+int cache_setores;
+int cache_mascara;
+long cache_acertos;
+long cache_faltas;
+
+/* Contadores de bl_stats, incrementados sem trava com CONTA */
+long conta_lidos;
+long conta_escritos;
+long conta_syncs;
+long conta_reqs;
+long conta_descartados;
+
+/* Protege o cache e seus contadores. As transferencias diretas (pread/pwrite,
+ * que nao dependem da posicao do descritor) e o fdatasync rodam sem ela. */
+pthread_mutex_t trava_cache = PTHREAD_MUTEX_INITIALIZER;
+
+/* Transfere os segmentos de memoria de/para setores contiguos da imagem,
+ * repetindo a chamada em caso de transferencia parcial. */
+static int disp_io(int sector, struct iovec *iov, int n, int escrita) {
+  off_t pos = (off_t) sector * SECTORSIZE;
+  size_t total = 0;
+
+  for (int i = 0; i < n; i++) {
+    total += iov[i].iov_len;
+  }
+  if (escrita) {
+    CONTA(conta_escritos, total / SECTORSIZE);
+  } else {
+    CONTA(conta_lidos, total / SECTORSIZE);
+  }
+
+  if (device_map != NULL) {
+    for (int i = 0; i < n; i++) {
+      if (sector < 0 || pos + (off_t) iov[i].iov_len > device_size) {
+        fprintf(stderr, "Erro acessando setor %d: fora da imagem\n", sector);
+        return 0;
+      }
+      if (escrita) {
+        memcpy(device_map + pos, iov[i].iov_base, iov[i].iov_len);
+      } else {
+        memcpy(iov[i].iov_base, device_map + pos, iov[i].iov_len);
+      }
+      pos += iov[i].iov_len;
+    }
+    return 1;
+  }
+
+  while (n > 0) {
+    ssize_t r;
+
+    if (escrita) {
+      r = pwritev(device_fd, iov, n, pos);
+    } else {
+      r = preadv(device_fd, iov, n, pos);
+    }
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      if (escrita) {
+        perror("Erro escrevendo setor");
+      } else if (r == 0) {
+        fprintf(stderr, "Erro lendo setor: fim da imagem\n");
+      } else {
+        perror("Erro lendo setor");
+      }
+      return 0;
+    }
+    pos += r;
+    while (n > 0 && (size_t) r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 1;
+}
+
+static int disp_range(int sector, int count, char *buffer, int escrita) {
+  struct iovec iov;
+
+  iov.iov_base = buffer;
+  iov.iov_len = (size_t) count * SECTORSIZE;
+  return disp_io(sector, &iov, 1, escrita);
+}
+
+static int disp_write(int sector, char *buffer) {
+  return disp_range(sector, 1, buffer, 1);
+}
+
+static int disp_read(int sector, char *buffer) {
+  return disp_range(sector, 1, buffer, 0);
+}
+
+static void lru_remove(bl_buffer *b) {
+  b->ant->prox = b->prox;
+  b->prox->ant = b->ant;
+}
+
+static void lru_insere(bl_buffer *b) {
+  b->prox = cache_lru.prox;
+  b->ant = &cache_lru;
+  cache_lru.prox->ant = b;
+  cache_lru.prox = b;
+}
+
+static bl_buffer *cache_busca(int sector) {
+  bl_buffer *b;
+
+  for (b = cache_baldes[sector & cache_mascara]; b != NULL; b = b->hash) {
+    if (b->sector == sector) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+static void hash_remove(bl_buffer *b) {
+  bl_buffer **p = &cache_baldes[b->sector & cache_mascara];
+
+  while (*p != b) {
+    p = &(*p)->hash;
+  }
+  *p = b->hash;
+}
+
+/* Obtem um buffer para o setor, reaproveitando o menos usado. */
+static bl_buffer *cache_aloca(int sector) {
+  bl_buffer *b = cache_lru.ant;
+
+  if (b->sector != -1) {
+    if (b->sujo && !disp_write(b->sector, b->dados)) {
+      return NULL;
+    }
+    hash_remove(b);
+  }
+  b->sector = sector;
+  b->sujo = 0;
+  b->hash = cache_baldes[sector & cache_mascara];
+  cache_baldes[sector & cache_mascara] = b;
+  return b;
+}
+
+static int compara_buffers(const void *a, const void *b) {
+  return (*(bl_buffer **) a)->sector - (*(bl_buffer **) b)->sector;
+}
+
+/* Grava os setores sujos do cache em ordem crescente de setor. */
+static int cache_grava() {
+  bl_buffer **sujos;
+  int n = 0;
+  int ok = 1;
+
+  if (cache_setores == 0) {
+    return 1;
+  }
+  sujos = malloc(cache_setores * sizeof(bl_buffer *));
+  if (sujos == NULL) {
+    perror("Alocando lista de setores sujos");
+    return 0;
+  }
+  for (int i = 0; i < cache_setores; i++) {
+    if (cache_buffers[i].sector != -1 && cache_buffers[i].sujo) {
+      sujos[n++] = &cache_buffers[i];
+    }
+  }
+  qsort(sujos, n, sizeof(bl_buffer *), compara_buffers);
+  for (int i = 0; i < n && ok; i++) {
+    if (disp_write(sujos[i]->sector, sujos[i]->dados)) {
+      sujos[i]->sujo = 0;
+    } else {
+      ok = 0;
+    }
+  }
+  free(sujos);
+  return ok;
+}
+
+int bl_cache_config(int setores) {
+  int baldes = 1;
+
+  if (device_fd != -1 && !bl_sync()) {
+    return 0;
+  }
+  pthread_mutex_lock(&trava_cache);
+  free(cache_buffers);
+  free(cache_baldes);
+  cache_buffers = NULL;
+  cache_baldes = NULL;
+  cache_setores = 0;
+  cache_lru.prox = cache_lru.ant = &cache_lru;
+
+  /* Com a imagem mapeada, o cache so duplicaria as paginas do mapeamento */
+  if (setores <= 0 || device_map != NULL) {
+    pthread_mutex_unlock(&trava_cache);
+    return 1;
+  }
+  while (baldes < setores) {
+    baldes *= 2;
+  }
+  cache_buffers = malloc(setores * sizeof(bl_buffer));
+  cache_baldes = calloc(baldes, sizeof(bl_buffer *));
+  if (cache_buffers == NULL || cache_baldes == NULL) {
+    perror("Alocando cache de setores");
+    free(cache_buffers);
+    free(cache_baldes);
+    cache_buffers = NULL;
+    cache_baldes = NULL;
+    pthread_mutex_unlock(&trava_cache);
+    return 0;
+  }
+  cache_setores = setores;
+  cache_mascara = baldes - 1;
+  for (int i = 0; i < setores; i++) {
+    cache_buffers[i].sector = -1;
+    cache_buffers[i].sujo = 0;
+    lru_insere(&cache_buffers[i]);
+  }
+  pthread_mutex_unlock(&trava_cache);
+  return 1;
+}
+
+void bl_cache_stats(long *acertos, long *faltas) {
+  pthread_mutex_lock(&trava_cache);
+  *acertos = cache_acertos;
+  *faltas = cache_faltas;
+  pthread_mutex_unlock(&trava_cache);
+}
+
+void bl_stats(bl_estatisticas *e) {
+  bl_cache_stats(&e->cache_acertos, &e->cache_faltas);
+  e->setores_lidos = __atomic_load_n(&conta_lidos, __ATOMIC_RELAXED);
+  e->setores_escritos = __atomic_load_n(&conta_escritos, __ATOMIC_RELAXED);
+  e->syncs = __atomic_load_n(&conta_syncs, __ATOMIC_RELAXED);
+  e->reqs_assincronas = __atomic_load_n(&conta_reqs, __ATOMIC_RELAXED);
+  e->setores_descartados = __atomic_load_n(&conta_descartados, __ATOMIC_RELAXED);
+}
+
+void bl_stats_reset() {
+  pthread_mutex_lock(&trava_cache);
+  cache_acertos = 0;
+  cache_faltas = 0;
+  pthread_mutex_unlock(&trava_cache);
+  __atomic_store_n(&conta_lidos, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&conta_escritos, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&conta_syncs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&conta_reqs, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&conta_descartados, 0, __ATOMIC_RELAXED);
+}
 
 int bl_init(char *file, int size) {
+  return bl_init_backend(file, size, BL_PREAD);
+}
+
+int bl_init_backend(char *file, int size, int backend) {
   struct stat sb;
 
-  stream = NULL;
+  /* Fecha a imagem aberta anteriormente, se houver */
+  if (device_fd != -1) {
+    bl_sync();
+    if (device_map != NULL) {
+      munmap(device_map, device_size);
+    }
+    close(device_fd);
+  }
+  device_fd = -1;
+  device_map = NULL;
   if (stat(file, &sb) == 0) {
     if (S_ISREG(sb.st_mode)) {
       device_size = sb.st_size;
-      stream = fopen(file, "r+");
+      device_fd = open(file, O_RDWR);
     }
-    if (stream == NULL) {
+    if (device_fd == -1) {
       perror("Abrindo imagem pré-existente");
       return 0;
     }
   } else {
-    device_size = size * SECTORSIZE;
+    device_size = (off_t) size * SECTORSIZE;
     if (device_size < 1) {
       printf("Imagem não pode ter tamanho zero\n");
       return 0;
     }
-    stream = fopen(file, "w+");
-    if (stream == NULL) {
+    device_fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (device_fd == -1) {
       perror("Criando nova imagem");
       return 0;
     }
-    if (truncate(file, device_size) == -1) {
+    if (ftruncate(device_fd, device_size) == -1) {
       perror("Ajustando tamanho da imagem");
+      close(device_fd);
+      device_fd = -1;
       return 0;
     }
   }
-  return 1; 
+  if (backend == BL_MMAP) {
+    device_map = mmap(NULL, device_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      device_fd, 0);
+    if (device_map == MAP_FAILED) {
+      perror("Mapeando imagem em memoria");
+      device_map = NULL;
+      close(device_fd);
+      device_fd = -1;
+      return 0;
+    }
+  }
+  return bl_cache_config(BL_CACHE_PADRAO); 
+}
+
+char *bl_map(int sector, int count) {
+  if (device_map == NULL || sector < 0 ||
+      (off_t) (sector + count) * SECTORSIZE > device_size) {
+    return NULL;
+  }
+  return device_map + (off_t) sector * SECTORSIZE;
 }
 
 int bl_size() {
   return device_size / SECTORSIZE;
 }
 
+/* Escrita e leitura de um setor pelo cache; o chamador tem a trava_cache. */
+static int cache_escreve(int sector, char *buffer) {
+  bl_buffer *b;
+
+  b = cache_busca(sector);
+  if (b == NULL) {
+    cache_faltas++;
+    if ((b = cache_aloca(sector)) == NULL) {
+      return 0;
+    }
+  } else {
+    cache_acertos++;
+  }
+  lru_remove(b);
+  lru_insere(b);
+  memcpy(b->dados, buffer, SECTORSIZE);
+  b->sujo = 1;
+  return 1;
+}
+
+static int cache_le(int sector, char *buffer) {
+  bl_buffer *b;
+
+  b = cache_busca(sector);
+  if (b == NULL) {
+    cache_faltas++;
+    if ((b = cache_aloca(sector)) == NULL) {
+      return 0;
+    }
+    if (!disp_read(sector, b->dados)) {
+      hash_remove(b);
+      b->sector = -1;
+      return 0;
+    }
+  } else {
+    cache_acertos++;
+  }
+  lru_remove(b);
+  lru_insere(b);
+  memcpy(buffer, b->dados, SECTORSIZE);
+  return 1;
+}
+
 int bl_write(int sector, char *buffer) {
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para escrita");
+  int ok;
+
+  if (cache_setores == 0) {
+    return disp_write(sector, buffer);
+  }
+  pthread_mutex_lock(&trava_cache);
+  ok = cache_escreve(sector, buffer);
+  pthread_mutex_unlock(&trava_cache);
+  return ok;
+}
+
+int bl_read(int sector, char *buffer){
+  int ok;
+
+  if (cache_setores == 0) {
+    return disp_read(sector, buffer);
+  }
+  pthread_mutex_lock(&trava_cache);
+  ok = cache_le(sector, buffer);
+  pthread_mutex_unlock(&trava_cache);
+  return ok;
+}
+
+/* Depois de uma leitura direta, sobrepoe as copias mais recentes que
+ * estiverem no cache. */
+static void cache_sobrepoe(int sector, int count, char *buffer) {
+  for (int i = 0; i < count; i++) {
+    bl_buffer *b = cache_busca(sector + i);
+
+    if (b != NULL) {
+      memcpy(buffer + i * SECTORSIZE, b->dados, SECTORSIZE);
+    }
+  }
+}
+
+/* Antes de uma escrita direta, atualiza as copias presentes no cache, que
+ * deixam de estar sujas. */
+static void cache_atualiza(int sector, int count, char *buffer) {
+  for (int i = 0; i < count; i++) {
+    bl_buffer *b = cache_busca(sector + i);
+
+    if (b != NULL) {
+      memcpy(b->dados, buffer + i * SECTORSIZE, SECTORSIZE);
+      b->sujo = 0;
+    }
+  }
+}
+
+int bl_read_range(int sector, int count, char *buffer) {
+  int ok = 1;
+
+  if (cache_setores > 0 && count < BL_RANGE_DIRETO) {
+    pthread_mutex_lock(&trava_cache);
+    for (int i = 0; i < count && ok; i++) {
+      ok = cache_le(sector + i, buffer + i * SECTORSIZE);
+    }
+    pthread_mutex_unlock(&trava_cache);
+    return ok;
+  }
+  if (!disp_range(sector, count, buffer, 0)) {
+    return 0;
+  }
+  if (cache_setores > 0) {
+    pthread_mutex_lock(&trava_cache);
+    cache_sobrepoe(sector, count, buffer);
+    pthread_mutex_unlock(&trava_cache);
+  }
+  return 1;
+}
+
+int bl_write_range(int sector, int count, char *buffer) {
+  int ok = 1;
+
+  if (cache_setores > 0 && count < BL_RANGE_DIRETO) {
+    pthread_mutex_lock(&trava_cache);
+    for (int i = 0; i < count && ok; i++) {
+      ok = cache_escreve(sector + i, buffer + i * SECTORSIZE);
+    }
+    pthread_mutex_unlock(&trava_cache);
+    return ok;
+  }
+  if (cache_setores > 0) {
+    pthread_mutex_lock(&trava_cache);
+    cache_atualiza(sector, count, buffer);
+    pthread_mutex_unlock(&trava_cache);
+  }
+  return disp_range(sector, count, buffer, 1);
+}
+
+/* Executa a lista de segmentos agrupando em uma chamada os que forem
+ * contiguos na imagem. */
+static int bl_vetor(bl_iovec *v, int n, int escrita) {
+  struct iovec iov[MAX_IOV];
+  int i = 0;
+
+  while (i < n) {
+    int inicio = v[i].sector;
+    int fim = inicio;
+    int k = 0;
+
+    while (i < n && k < MAX_IOV && v[i].sector == fim) {
+      if (escrita && cache_setores > 0) {
+        pthread_mutex_lock(&trava_cache);
+        cache_atualiza(v[i].sector, v[i].count, v[i].buffer);
+        pthread_mutex_unlock(&trava_cache);
+      }
+      iov[k].iov_base = v[i].buffer;
+      iov[k].iov_len = (size_t) v[i].count * SECTORSIZE;
+      fim += v[i].count;
+      k++;
+      i++;
+    }
+    if (!disp_io(inicio, iov, k, escrita)) {
+      return 0;
+    }
+    if (!escrita && cache_setores > 0) {
+      pthread_mutex_lock(&trava_cache);
+      for (int j = i - k; j < i; j++) {
+        cache_sobrepoe(v[j].sector, v[j].count, v[j].buffer);
+      }
+      pthread_mutex_unlock(&trava_cache);
+    }
+  }
+  return 1;
+}
+
+int bl_readv(bl_iovec *v, int n) {
+  return bl_vetor(v, n, 0);
+}
+
+int bl_writev(bl_iovec *v, int n) {
+  return bl_vetor(v, n, 1);
+}
+
+/* Copias em massa entre um arquivo real e a imagem. Os dados vao de um
+ * descritor ao outro pelo kernel (copy_file_range), sem passar por buffers
+ * do processo; se o sistema nao permitir, a copia usa um buffer grande. */
+
+#define COPIA_BUFFER (1024 * 1024)
+
+/* Grava as copias sujas da faixa de setores presentes no cache e, se
+ * descarta, tira todas elas do cache; com trava_cache. */
+static int cache_libera(int sector, int count, int descarta) {
+  for (int i = 0; i < count; i++) {
+    bl_buffer *b = cache_busca(sector + i);
+
+    if (b == NULL) {
+      continue;
+    }
+    if (b->sujo) {
+      if (!disp_write(b->sector, b->dados)) {
+        return 0;
+      }
+      b->sujo = 0;
+    }
+    if (descarta) {
+      hash_remove(b);
+      b->sector = -1;
+    }
+  }
+  return 1;
+}
+
+/* Transfere bytes entre o arquivo fd e a memoria, repetindo a chamada em
+ * caso de transferencia parcial. */
+static int copia_memoria(int fd, off_t pos, char *mem, long long bytes,
+                         int escrita) {
+  while (bytes > 0) {
+    ssize_t r;
+
+    if (escrita) {
+      r = pwrite(fd, mem, bytes, pos);
+    } else {
+      r = pread(fd, mem, bytes, pos);
+    }
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      if (r == 0) {
+        fprintf(stderr, "Erro copiando dados: fim do arquivo\n");
+      } else {
+        perror("Erro copiando dados");
+      }
+      return 0;
+    }
+    mem += r;
+    pos += r;
+    bytes -= r;
+  }
+  return 1;
+}
+
+static int copia(int origem, off_t pos_origem, int destino, off_t pos_destino,
+                 long long bytes) {
+  char *buffer = NULL;
+  int ok = 1;
+
+  while (bytes > 0 && ok) {
+    ssize_t r;
+
+    if (buffer == NULL) {
+      r = copy_file_range(origem, &pos_origem, destino, &pos_destino, bytes, 0);
+      if (r == -1 && errno == EINTR) {
+        continue;
+      }
+      if (r == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                      errno == EOPNOTSUPP || errno == EBADF)) {
+        buffer = malloc(COPIA_BUFFER);
+        if (buffer == NULL) {
+          perror("Alocando buffer de copia");
+          return 0;
+        }
+        continue;
+      }
+      if (r <= 0) {
+        if (r == 0) {
+          fprintf(stderr, "Erro copiando dados: fim do arquivo\n");
+        } else {
+          perror("Erro copiando dados");
+        }
+        ok = 0;
+      }
+    } else {
+      r = bytes < COPIA_BUFFER ? bytes : COPIA_BUFFER;
+      ok = copia_memoria(origem, pos_origem, buffer, r, 0) &&
+           copia_memoria(destino, pos_destino, buffer, r, 1);
+      pos_origem += r;
+      pos_destino += r;
+    }
+    bytes -= r;
+  }
+  free(buffer);
+  return ok;
+}
+
+int bl_import(int fd, long long origem, long long destino, long long bytes) {
+  int sector = destino / SECTORSIZE;
+  int count = (destino + bytes + SECTORSIZE - 1) / SECTORSIZE - sector;
+  int ok = 1;
+
+  if (destino < 0 || destino + bytes > device_size) {
+    fprintf(stderr, "Erro acessando setor %d: fora da imagem\n", sector);
     return 0;
   }
-  if (fwrite(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro escrevendo setor");
+  if (device_map != NULL) {
+    return copia_memoria(fd, origem, device_map + destino, bytes, 0);
+  }
+  /* As copias antigas saem do cache; as sujas vao antes para a imagem, ja
+   * que a faixa pode comecar ou terminar no meio de um setor */
+  if (cache_setores > 0) {
+    pthread_mutex_lock(&trava_cache);
+    ok = cache_libera(sector, count, 1);
+    pthread_mutex_unlock(&trava_cache);
+  }
+  CONTA(conta_escritos, count);
+  return ok && copia(fd, origem, device_fd, destino, bytes);
+}
+
+int bl_export(long long origem, long long bytes, int fd, long long destino) {
+  int sector = origem / SECTORSIZE;
+  int count = (origem + bytes + SECTORSIZE - 1) / SECTORSIZE - sector;
+  int ok = 1;
+
+  if (origem < 0 || origem + bytes > device_size) {
+    fprintf(stderr, "Erro acessando setor %d: fora da imagem\n", sector);
     return 0;
   }
-  if (fflush(stream) != 0) {
-    perror("Erro gravando setor no disco");
+  if (device_map != NULL) {
+    return copia_memoria(fd, destino, device_map + origem, bytes, 1);
+  }
+  if (cache_setores > 0) {
+    pthread_mutex_lock(&trava_cache);
+    ok = cache_libera(sector, count, 0);
+    pthread_mutex_unlock(&trava_cache);
+  }
+  CONTA(conta_lidos, count);
+  return ok && copia(device_fd, origem, fd, destino, bytes);
+}
+
+/* Descarte de setores: a faixa vira um buraco na imagem (o sistema de
+ * arquivos devolve o espaco e a faixa passa a ser lida como zeros). Depois
+ * do descarte, as copias no cache sao esquecidas, mesmo as sujas. */
+int bl_discard(int sector, int count) {
+  off_t inicio = (off_t) sector * SECTORSIZE;
+  off_t bytes = (off_t) count * SECTORSIZE;
+
+  if (sector < 0 || count <= 0 || inicio + bytes > device_size) {
     return 0;
   }
+#ifdef __linux__
+  int ok;
+
+  /* Com trava_cache, para nenhuma copia voltar ao cache no meio */
+  pthread_mutex_lock(&trava_cache);
+  ok = fallocate(device_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 inicio, bytes) == 0;
+  for (int i = 0; ok && cache_setores > 0 && i < count; i++) {
+    bl_buffer *b = cache_busca(sector + i);
+
+    if (b != NULL) {
+      hash_remove(b);
+      b->sector = -1;
+      b->sujo = 0;
+    }
+  }
+  pthread_mutex_unlock(&trava_cache);
+  if (ok) {
+    CONTA(conta_descartados, count);
+  }
+  return ok;
+#else
+  return 0;
+#endif
+}
+
+/* E/S assincrona. As requisicoes vao para o io_uring (ou, sem ele, para uma
+ * fila atendida por AIO_THREADS threads) e, depois de transferidas, esperam
+ * em aio_prontas ate que bl_poll ou bl_wait as finalizem: completam
+ * transferencias curtas, sobrepoem o cache nas leituras e chamam concluido.
+ * Como nas transferencias diretas, as requisicoes nao passam pelo cache. */
+
+#define AIO_ANEL 64                 /* Entradas do anel de submissao */
+#define AIO_THREADS 4
+#define AIO_EM_VOO 1
+#define AIO_CONCLUIDA 2
+
+pthread_mutex_t trava_aio = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;       /* Conclusoes */
+pthread_cond_t aio_trabalho = PTHREAD_COND_INITIALIZER;   /* Fila das threads */
+int aio_modo = -1;                  /* -1 ate o primeiro uso */
+int aio_threads;                    /* Threads ja criadas */
+int aio_pendentes;                  /* Submetidas e ainda nao finalizadas */
+bl_req *aio_fila, *aio_fila_fim;    /* Esperando uma thread */
+bl_req *aio_prontas, *aio_prontas_fim;
+int aio_colhendo;                   /* Alguma thread espera no io_uring_enter */
+
+static void aio_enfileira(bl_req **inicio, bl_req **fim, bl_req *r) {
+  r->prox = NULL;
+  if (*inicio == NULL) {
+    *inicio = r;
+  } else {
+    (*fim)->prox = r;
+  }
+  *fim = r;
+}
+
+#ifdef __linux__
+
+/* Anel do io_uring, acessado com chamadas diretas ao sistema */
+struct {
+  int fd;
+  unsigned *sq_cabeca, *sq_cauda, *sq_mascara, *sq_vetor;
+  unsigned *cq_cabeca, *cq_cauda, *cq_mascara;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned entradas;
+  unsigned cq_entradas;
+  unsigned em_voo;                  /* Submetidas e nao colhidas do anel */
+  unsigned a_enviar;                /* Preparadas e ainda nao enviadas */
+} anel = { .fd = -1 };
+
+static int uring_inicia() {
+  struct io_uring_params p;
+  size_t tam_sq, tam_cq;
+  char *sq, *cq;
+
+  if (anel.fd != -1) {
+    return 1;
+  }
+  memset(&p, 0, sizeof(p));
+  anel.fd = syscall(__NR_io_uring_setup, AIO_ANEL, &p);
+  if (anel.fd < 0) {
+    anel.fd = -1;
+    return 0;
+  }
+  tam_sq = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  tam_cq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && tam_cq > tam_sq) {
+    tam_sq = tam_cq;
+  }
+  sq = mmap(NULL, tam_sq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            anel.fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(anel.fd);
+    anel.fd = -1;
+    return 0;
+  }
+  cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, tam_cq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              anel.fd, IORING_OFF_CQ_RING);
+  }
+  anel.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   anel.fd, IORING_OFF_SQES);
+  if (cq == MAP_FAILED || anel.sqes == MAP_FAILED) {
+    close(anel.fd);
+    anel.fd = -1;
+    return 0;
+  }
+  anel.sq_cabeca = (unsigned *) (sq + p.sq_off.head);
+  anel.sq_cauda = (unsigned *) (sq + p.sq_off.tail);
+  anel.sq_mascara = (unsigned *) (sq + p.sq_off.ring_mask);
+  anel.sq_vetor = (unsigned *) (sq + p.sq_off.array);
+  anel.cq_cabeca = (unsigned *) (cq + p.cq_off.head);
+  anel.cq_cauda = (unsigned *) (cq + p.cq_off.tail);
+  anel.cq_mascara = (unsigned *) (cq + p.cq_off.ring_mask);
+  anel.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  anel.entradas = p.sq_entries;
+  anel.cq_entradas = p.cq_entries;
   return 1;
 }
 
-int bl_read(int sector, char *buffer){
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para leitura");
+/* Passa as conclusoes do anel para aio_prontas; com trava_aio. Uma
+ * transferencia curta ou com erro vai assim mesmo: o restante e refeito de
+ * forma sincrona na finalizacao. */
+static int uring_colhe() {
+  unsigned cabeca = *anel.cq_cabeca;
+  unsigned cauda = __atomic_load_n(anel.cq_cauda, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  while (cabeca != cauda) {
+    struct io_uring_cqe *cqe = &anel.cqes[cabeca & *anel.cq_mascara];
+    bl_req *r = (bl_req *) (uintptr_t) cqe->user_data;
+
+    if (cqe->res > 0) {
+      r->feito += cqe->res;
+      if (r->escrita) {
+        CONTA(conta_escritos, cqe->res / SECTORSIZE);
+      } else {
+        CONTA(conta_lidos, cqe->res / SECTORSIZE);
+      }
+    }
+    aio_enfileira(&aio_prontas, &aio_prontas_fim, r);
+    anel.em_voo--;
+    cabeca++;
+    n++;
+  }
+  __atomic_store_n(anel.cq_cabeca, cabeca, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* Envia as entradas preparadas e, se espera, aguarda ao menos uma
+ * conclusao; com trava_aio, exceto quando a espera e feita sem ela. */
+static int uring_entra(unsigned enviar, int espera) {
+  int r;
+
+  do {
+    r = syscall(__NR_io_uring_enter, anel.fd, enviar, espera ? 1 : 0,
+                espera ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0 && errno != EAGAIN && errno != EBUSY) {
+    perror("Erro submetendo E/S assincrona");
+  }
+  return r;
+}
+
+static void uring_envia() {
+  while (anel.a_enviar > 0) {
+    int r = uring_entra(anel.a_enviar, 0);
+
+    if (r > 0) {
+      anel.a_enviar -= r;
+    } else if (r < 0 && errno != EAGAIN && errno != EBUSY) {
+      return;
+    } else if (uring_colhe() == 0) {
+      /* Anel de conclusoes cheio: espera abrir espaco */
+      uring_entra(0, 1);
+      uring_colhe();
+    }
+  }
+}
+
+static void uring_prepara(bl_req *r) {
+  unsigned cauda = *anel.sq_cauda;
+  unsigned i;
+  struct io_uring_sqe *sqe;
+
+  /* Abre espaco no anel de submissao e no de conclusoes */
+  while (cauda - __atomic_load_n(anel.sq_cabeca, __ATOMIC_ACQUIRE) >= anel.entradas ||
+         anel.em_voo >= anel.cq_entradas) {
+    uring_envia();
+    if (anel.em_voo >= anel.cq_entradas && uring_colhe() == 0) {
+      uring_entra(0, 1);
+      uring_colhe();
+    }
+  }
+  i = cauda & *anel.sq_mascara;
+  sqe = &anel.sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = r->escrita ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = device_fd;
+  sqe->off = (off_t) r->sector * SECTORSIZE;
+  sqe->addr = (uintptr_t) r->buffer;
+  sqe->len = r->count * SECTORSIZE;
+  sqe->user_data = (uintptr_t) r;
+  anel.sq_vetor[i] = i;
+  __atomic_store_n(anel.sq_cauda, cauda + 1, __ATOMIC_RELEASE);
+  anel.a_enviar++;
+  anel.em_voo++;
+}
+
+#else
+
+static int uring_inicia() {
+  return 0;
+}
+
+#endif
+
+static void *aio_trabalhador(void *arg) {
+  pthread_mutex_lock(&trava_aio);
+  for (;;) {
+    bl_req *r;
+
+    while (aio_fila == NULL) {
+      pthread_cond_wait(&aio_trabalho, &trava_aio);
+    }
+    r = aio_fila;
+    aio_fila = r->prox;
+    pthread_mutex_unlock(&trava_aio);
+    if (disp_range(r->sector, r->count, r->buffer, r->escrita)) {
+      r->feito = (long) r->count * SECTORSIZE;
+    }
+    pthread_mutex_lock(&trava_aio);
+    aio_enfileira(&aio_prontas, &aio_prontas_fim, r);
+    pthread_cond_broadcast(&aio_cond);
+  }
+  return arg;
+}
+
+/* Escolhe o motor na primeira submissao; com trava_aio. */
+static void aio_inicia(int modo) {
+  if (modo == BL_AIO_URING && !uring_inicia()) {
+    modo = BL_AIO_THREADS;
+  }
+  while (modo == BL_AIO_THREADS && aio_threads < AIO_THREADS) {
+    pthread_t t;
+
+    if (pthread_create(&t, NULL, aio_trabalhador, NULL) != 0) {
+      break;
+    }
+    pthread_detach(t);
+    aio_threads++;
+  }
+  if (modo == BL_AIO_THREADS && aio_threads == 0) {
+    modo = BL_AIO_SINCRONO;
+  }
+  aio_modo = modo;
+}
+
+int bl_aio_config(int modo) {
+  bl_wait(NULL);
+  pthread_mutex_lock(&trava_aio);
+  aio_inicia(modo);
+  modo = aio_modo;
+  pthread_mutex_unlock(&trava_aio);
+  return modo;
+}
+
+int bl_submit(bl_req *reqs, int n) {
+  int ok = 1;
+
+  /* As copias no cache sao atualizadas antes das escritas. Antes das
+   * leituras, as copias sujas vao para a imagem: a requisicao pode ficar em
+   * voo enquanto elas saem do cache, e a sobreposicao na finalizacao nao as
+   * acharia mais. */
+  for (int i = 0; i < n; i++) {
+    reqs[i].estado = AIO_EM_VOO;
+    reqs[i].resultado = 0;
+    reqs[i].feito = 0;
+    if (cache_setores > 0) {
+      pthread_mutex_lock(&trava_cache);
+      if (reqs[i].escrita) {
+        cache_atualiza(reqs[i].sector, reqs[i].count, reqs[i].buffer);
+      } else {
+        ok = cache_libera(reqs[i].sector, reqs[i].count, 0) && ok;
+      }
+      pthread_mutex_unlock(&trava_cache);
+    }
+  }
+
+  CONTA(conta_reqs, n);
+  pthread_mutex_lock(&trava_aio);
+  if (aio_modo == -1) {
+    aio_inicia(BL_AIO_URING);
+  }
+  aio_pendentes += n;
+  for (int i = 0; i < n; i++) {
+    bl_req *r = &reqs[i];
+
+    if (aio_modo == BL_AIO_SINCRONO || device_map != NULL) {
+      aio_enfileira(&aio_prontas, &aio_prontas_fim, r);
+#ifdef __linux__
+    } else if (aio_modo == BL_AIO_URING) {
+      uring_prepara(r);
+#endif
+    } else {
+      aio_enfileira(&aio_fila, &aio_fila_fim, r);
+    }
+  }
+#ifdef __linux__
+  if (aio_modo == BL_AIO_URING) {
+    uring_envia();
+  }
+#endif
+  if (aio_fila != NULL) {
+    pthread_cond_broadcast(&aio_trabalho);
+  }
+  pthread_mutex_unlock(&trava_aio);
+  return ok;
+}
+
+/* Finaliza as requisicoes transferidas; sem trava_aio. */
+static int aio_finaliza(bl_req *lista) {
+  int n = 0;
+
+  for (bl_req *r = lista; r != NULL; r = r->prox) {
+    long total = (long) r->count * SECTORSIZE;
+    int ok = 1;
+
+    /* Restante de transferencia curta ou que falhou, refeito a partir do
+     * inicio do setor incompleto (no modo sincrono, a transferencia toda) */
+    if (r->feito < total) {
+      int setores = r->feito / SECTORSIZE;
+
+      ok = disp_range(r->sector + setores, r->count - setores,
+                      r->buffer + (long) setores * SECTORSIZE, r->escrita);
+    }
+    if (ok && !r->escrita && cache_setores > 0) {
+      pthread_mutex_lock(&trava_cache);
+      cache_sobrepoe(r->sector, r->count, r->buffer);
+      pthread_mutex_unlock(&trava_cache);
+    }
+    r->resultado = ok;
+    if (r->concluido != NULL) {
+      r->concluido(r);
+    }
+    n++;
+  }
+
+  /* Depois de marcada como concluida, a requisicao pertence ao chamador */
+  pthread_mutex_lock(&trava_aio);
+  while (lista != NULL) {
+    bl_req *prox = lista->prox;
+
+    lista->estado = AIO_CONCLUIDA;
+    lista = prox;
+  }
+  aio_pendentes -= n;
+  pthread_cond_broadcast(&aio_cond);
+  pthread_mutex_unlock(&trava_aio);
+  return n;
+}
+
+int bl_poll() {
+  bl_req *lista;
+
+  pthread_mutex_lock(&trava_aio);
+#ifdef __linux__
+  if (aio_modo == BL_AIO_URING) {
+    uring_colhe();
+  }
+#endif
+  lista = aio_prontas;
+  aio_prontas = NULL;
+  pthread_mutex_unlock(&trava_aio);
+  if (lista == NULL) {
+    return 0;
+  }
+  return aio_finaliza(lista);
+}
+
+/* Espera a conclusao de req, ou de todas as requisicoes se req for NULL. */
+int bl_wait(bl_req *req) {
+  for (;;) {
+    bl_poll();
+    pthread_mutex_lock(&trava_aio);
+    if (req != NULL ? req->estado == AIO_CONCLUIDA : aio_pendentes == 0) {
+      pthread_mutex_unlock(&trava_aio);
+      break;
+    }
+#ifdef __linux__
+    if (aio_modo == BL_AIO_URING && aio_prontas == NULL && !aio_colhendo &&
+        anel.em_voo > 0) {
+      /* Uma so thread fica no kernel; as outras esperam pelo sinal dela */
+      aio_colhendo = 1;
+      pthread_mutex_unlock(&trava_aio);
+      uring_entra(0, 1);
+      pthread_mutex_lock(&trava_aio);
+      aio_colhendo = 0;
+      pthread_cond_broadcast(&aio_cond);
+      pthread_mutex_unlock(&trava_aio);
+      continue;
+    }
+#endif
+    if (aio_prontas == NULL) {
+      pthread_cond_wait(&aio_cond, &trava_aio);
+    }
+    pthread_mutex_unlock(&trava_aio);
+  }
+  return req != NULL ? req->resultado : 1;
+}
+
+int bl_sync() {
+  int ok;
+
+  /* Escritas assincronas ainda em andamento tambem vao para o disco */
+  bl_wait(NULL);
+  CONTA(conta_syncs, 1);
+  if (device_map != NULL) {
+    if (msync(device_map, device_size, MS_SYNC) == -1) {
+      perror("Erro gravando imagem mapeada no disco");
+      return 0;
+    }
+    return 1;
+  }
+  pthread_mutex_lock(&trava_cache);
+  ok = cache_grava();
+  pthread_mutex_unlock(&trava_cache);
+  if (!ok) {
     return 0;
   }
-  if (fread(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro lendo setor");
+  if (fdatasync(device_fd) == -1) {
+    perror("Erro gravando imagem no disco");
     return 0;
   }
   return 1;
@@ -22,7 +22,83 @@
 
 #define SECTORSIZE 512
 
+/* Backends de acesso a imagem, escolhidos em bl_init_backend. */
+#define BL_PREAD 0    /* pread/pwrite com cache de setores */
+#define BL_MMAP 1     /* imagem inteira mapeada em memoria */
+
+/* Numero de setores mantidos no cache quando a imagem e aberta. */
+#define BL_CACHE_PADRAO 2048
+
+/* Transferencias com pelo menos este numero de setores nao passam pelo
+ * cache: vao direto para a imagem. */
+#define BL_RANGE_DIRETO 8
+
+/* Soma n a um contador de estatisticas sem trava (bl_stats e fs_stats). */
+#define CONTA(contador, n) __atomic_fetch_add(&(contador), (n), __ATOMIC_RELAXED)
+
+/* Segmento de uma transferencia vetorial: count setores a partir de sector. */
+typedef struct {
+  int sector;
+  int count;
+  char *buffer;
+} bl_iovec;
+
+/* Motores de E/S assincrona, escolhidos em bl_aio_config. */
+#define BL_AIO_SINCRONO 0   /* executa a requisicao na propria submissao */
+#define BL_AIO_URING 1      /* io_uring do Linux */
+#define BL_AIO_THREADS 2    /* grupo de threads fazendo pread/pwrite */
+
+/* Requisicao assincrona de count setores a partir de sector. O buffer nao
+ * deve ser usado ate a conclusao. concluido, se nao for NULL, e chamado na
+ * thread que colher a conclusao (em bl_poll ou bl_wait); resultado fica 1 em
+ * caso de sucesso. Os demais campos sao de uso interno. */
+typedef struct bl_req {
+  int sector;
+  int count;
+  char *buffer;
+  int escrita;
+  void (*concluido)(struct bl_req *req);
+  void *arg;
+  int resultado;
+  int estado;
+  long feito;
+  struct bl_req *prox;
+} bl_req;
+
+/* Contadores do dispositivo, desde a abertura ou o ultimo bl_stats_reset. */
+typedef struct {
+  long setores_lidos;
+  long setores_escritos;
+  long syncs;                 /* Chamadas a bl_sync */
+  long cache_acertos;
+  long cache_faltas;
+  long reqs_assincronas;
+  long setores_descartados;   /* Setores que viraram buracos (bl_discard) */
+} bl_estatisticas;
+
 int bl_init(char *file, int size);
+int bl_init_backend(char *file, int size, int backend);
 int bl_size();
 int bl_write(int sector, char* buffer);
 int bl_read(int sector, char* buffer);
+int bl_read_range(int sector, int count, char *buffer);
+int bl_write_range(int sector, int count, char *buffer);
+int bl_readv(bl_iovec *v, int n);
+int bl_writev(bl_iovec *v, int n);
+char *bl_map(int sector, int count);
+/* Copias em massa entre o arquivo real fd e a imagem; origem e destino sao
+ * posicoes em bytes. */
+int bl_import(int fd, long long origem, long long destino, long long bytes);
+int bl_export(long long origem, long long bytes, int fd, long long destino);
+/* Torna a faixa um buraco da imagem, lido como zeros; retorna 0 se o sistema
+ * nao permitir, e entao a faixa fica como estava. */
+int bl_discard(int sector, int count);
+int bl_submit(bl_req *reqs, int n);
+int bl_poll();
+int bl_wait(bl_req *req);
+int bl_aio_config(int modo);
+int bl_sync();
+int bl_cache_config(int setores);
+void bl_cache_stats(long *acertos, long *faltas);
+void bl_stats(bl_estatisticas *e);
+void bl_stats_reset();
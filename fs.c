@@ -20,553 +20,4696 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "crc.h"
 #include "disk.h"
 #include "fs.h"
 
-#define CLUSTERSIZE 4096
+/* Superbloco: setor 0 do disco, com a geometria escolhida na formatacao.
+ * O agrupamento 0 fica reservado para ele; em seguida vem a FAT (uma entrada
+ * de 32 bits por agrupamento), o diretorio raiz, o journal, a tabela de
+ * somas dos setores (opcional) e os dados. */
+#define SUPER_MAGICA 0x53465352
+#define SUPER_VERSAO 2
+#define AGRUP_MIN 512
+#define AGRUP_MAX 65536
+#define ORFAOS 8
 
-unsigned short fat[65536];
+typedef struct {
+  unsigned int magica;
+  unsigned int versao;
+  unsigned int tam_agrup;       //Bytes por agrupamento, potencia de 2
+  unsigned int num_agrups;
+  unsigned int agrup_fat;       //Primeiro agrupamento e tamanho de cada regiao
+  unsigned int agrups_fat;
+  unsigned int agrup_dir;
+  unsigned int agrups_dir;
+  unsigned int agrup_journal;
+  unsigned int agrups_journal;
+  unsigned int primeiro_dado;
+  unsigned int crc;             //Do setor todo, com crc 0
+  unsigned int agrup_somas;     //Tabela de somas dos setores, entre o journal
+  unsigned int agrups_somas;    //e os dados (0 agrupamentos sem ela)
+  unsigned int agrup_refs;      //Raiz da arvore de referencias
+  unsigned int agrup_orfaos[ORFAOS]; //Cadeias a liberar na montagem (0: nenhuma)
+  char reservado[SECTORSIZE - (15 + ORFAOS) * sizeof(unsigned int)];
+} superbloco;
+
+superbloco super;
+int super_sujo;                 //Se as cadeias orfas mudaram desde a gravacao
+int tam_agrup = FS_AGRUP_PADRAO;
+int setores_agrup = FS_AGRUP_PADRAO / SECTORSIZE;
+
+/* CRC do superbloco em RAM, calculado com o campo crc zerado */
+static unsigned int crc_super() {
+  unsigned int crc_gravado = super.crc;
+
+  super.crc = 0;
+  unsigned int crc = crc32c(0, &super, sizeof(superbloco));
+  super.crc = crc_gravado;
+  return crc;
+}
 
 typedef struct {
        char used;
        char name[25];
-       unsigned short first_block;
+       char dono;            //Pode crescer na cadeia compartilhada
+       unsigned int first_block;
        int size;
 } dir_entry;
 
+/* Sequencia de agrupamentos contiguos no disco dentro da cadeia de um
+ * arquivo */
 typedef struct {
-	char estado;
-   	int posAtual;
+	int agrup;           //Primeiro agrupamento da sequencia
+	int inicio;          //Ordem desse agrupamento na cadeia do arquivo
+	int tam;             //Quantidade de agrupamentos
+} Extensao;
+
+/* Arquivo aberto por um ou mais descritores: no maximo um para escrita e
+ * quantos forem para leitura */
+typedef struct {
+	int abertos;         //Descritores abertos no arquivo
+	char escrita;        //Se um deles e de escrita
+	Extensao *ext;       //Mapa de extensoes da cadeia, montado na abertura
+	int numExt;
+	int capExt;
+	int extAtual;        //Cursor da escrita: extensao da ultima transferencia
+	int compartilhado;   //Ordem do primeiro agrupamento da cadeia que outro
+	                     //arquivo tambem alcanca (INT_MAX: nenhum)
+	int setorParcial;    //Setor incompleto no fim do arquivo (escrita),
+	char parcialSujo;    //se o buffer tem bytes ainda nao gravados
+	char parcial[SECTORSIZE];
+	unsigned versao;     //Muda quando dados ja existentes sao regravados
+	pthread_rwlock_t trava;
 } Arquivo;
 
-dir_entry dir[128];
-Arquivo arquivos[128];
+/* Leitura antecipada: cada janela guarda um trecho do arquivo lido do disco
+ * por requisicoes assincronas */
+#define ANTECIPA_MIN (64 * 1024)
+#define ANTECIPA_MAX (1024 * 1024)
+#define ANTECIPA_REQS 32
+
+typedef struct {
+	char *dados;
+	int ini;             //Trecho [ini, fim) do arquivo
+	int fim;
+	unsigned versao;     //Versao e tamanho do arquivo quando o trecho foi
+	int tamanho;         //pedido
+	int numReqs;         //Requisicoes ainda nao esperadas
+	bl_req reqs[ANTECIPA_REQS];
+} Janela;
+
+typedef struct {
+	Janela j[2];         //A janela em uso e a seguinte, lida em segundo plano
+	int atual;
+} Antecipa;
+
+/* Descritor devolvido por fs_open, com a posicao propria de fs_read */
+typedef struct {
+	char estado;
+	int arquivo;         //Entrada do arquivo em arquivos[]
+   	int posAtual;
+	int extAtual;        //Cursor: extensao da ultima leitura
+	int proxSeq;         //Onde uma leitura sequencial continuaria
+	int janela;          //Bytes lidos antecipadamente, 0 sem antecipacao
+	Antecipa *ant;       //Criada na primeira leitura sequencial
+	pthread_rwlock_t trava;
+} Descritor;
 
-/* Constantes de Agrupamentos */
+/* Constantes de Agrupamentos: valores da FAT que nao sao o proximo
+ * agrupamento da cadeia */
 
-#define AGRUP_LIVRE 1
-#define AGRUP_ULTIMO 2
-#define AGRUP_FAT 3
-#define AGRUP_DIR 4
-#define SIZE_FAT 65536
+#define AGRUP_LIVRE 0xFFFFFFF1u
+#define AGRUP_ULTIMO 0xFFFFFFF2u
+#define AGRUP_FAT 0xFFFFFFF3u
+#define AGRUP_DIR 0xFFFFFFF4u
+#define AGRUP_JOURNAL 0xFFFFFFF5u
+#define AGRUP_SUPER 0xFFFFFFF6u
+#define AGRUP_SOMAS 0xFFFFFFF7u
 #define SIZE_DIR 128
 
+/* Arquivos de subdiretorios abertos ganham uma entrada espelho depois das
+ * SIZE_DIR entradas da raiz, com a copia do registro guardado na arvore */
+#define ABERTOS_SUB 128
+#define SIZE_ARQUIVOS (SIZE_DIR + ABERTOS_SUB)
+
+dir_entry dir[SIZE_ARQUIVOS];
+Arquivo arquivos[SIZE_ARQUIVOS];
+
+#define NUM_DESCRITORES (2 * SIZE_ARQUIVOS)
+Descritor descritores[NUM_DESCRITORES];
+short descritores_livres[NUM_DESCRITORES];
+int num_descritores_livres;
+
 /* Constantes de Arquivos */
 #define ARQ_FECHADO 'C'
 #define ARQ_ABERTO_ESCRITA 'W'
 #define ARQ_ABERTO_LEITURA 'R'
 
-int fs_init() {
-  //Carregando FAT
-  for(int agrupamento = 0; agrupamento < 32; agrupamento++)
+/* Travas, sempre obtidas nesta ordem:
+ *  trava_dir    (leitura/escrita) nomes e ocupacao das entradas do diretorio
+ *  descritores[d].trava    (leitura/escrita) estado e posicao do descritor
+ *  arquivos[i].trava       (leitura/escrita) descritores abertos e dados de
+ *                          um arquivo; leituras dividem a trava
+ *  trava_meta   conteudo da FAT e das entradas, alocador, setores sujos,
+ *               journal e descritores livres
+ *  trava_somas  (leitura/escrita) gravacoes e carga da tabela de somas, e
+ *               os setores incompletos lidos e gravados junto com a soma
+ * O cache do disco tem sua propria trava em disk.c. fs_init e fs_format nao
+ * devem rodar junto com outras operacoes; a thread que confirma o journal
+ * no prazo fica fora delas pela trava_dir. */
+pthread_rwlock_t trava_dir = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t trava_meta = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t travas_iniciadas = PTHREAD_ONCE_INIT;
+pthread_cond_t journal_aviso;        //Com trava_meta: operacoes pendentes
+                                     //ou prazo alterado
+
+static void *confirmador(void *arg);
+
+static void inicia_travas() {
+  pthread_condattr_t atrib;
+  pthread_t thread;
+
+  for(int i = 0; i < SIZE_ARQUIVOS; i++)
+    pthread_rwlock_init(&arquivos[i].trava, NULL);
+  for(int d = 0; d < NUM_DESCRITORES; d++)
+    pthread_rwlock_init(&descritores[d].trava, NULL);
+
+  //Os prazos do journal sao contados no relogio monotonico
+  pthread_condattr_init(&atrib);
+  pthread_condattr_setclock(&atrib, CLOCK_MONOTONIC);
+  pthread_cond_init(&journal_aviso, &atrib);
+  pthread_condattr_destroy(&atrib);
+  if(pthread_create(&thread, NULL, confirmador, NULL) != 0)
+    printf("Erro: Nao foi possivel criar a thread do journal!\n");
+  else
+    pthread_detach(thread);
+}
+
+static int arquivo_valido(int file) {
+  if(file < 0 || file >= NUM_DESCRITORES)
   {
-      for(int sector = 0; sector < 8; sector++)
-      {
-        char buffer[SECTORSIZE];
-        if(!bl_read((agrupamento*8 + sector), buffer))
-        {
-            printf("Erro no carregamento da FAT. Disco nao esta formatado!\n");
-            return 0;
-        }
-        memcpy(((char*) fat)+((agrupamento*8+sector)*SECTORSIZE), buffer, SECTORSIZE);
-      }
+    printf("Erro: Arquivo invalido!\n");
+    return 0;
   }
-  //Verficando integridade
-  for(int i = 0; i < 32; i++)
+  return 1;
+}
+
+/* Contadores de fs_stats, incrementados sem trava (CONTA, de disk.h) */
+fs_estatisticas estat;
+
+static void op_inicia(struct timespec *inicio) {
+  clock_gettime(CLOCK_MONOTONIC, inicio);
+}
+
+static void op_conclui(int op, struct timespec *inicio) {
+  struct timespec fim;
+  clock_gettime(CLOCK_MONOTONIC, &fim);
+  long long ns = (fim.tv_sec - inicio->tv_sec) * 1000000000LL + fim.tv_nsec - inicio->tv_nsec;
+  long us = ns / 1000;
+
+  int faixa = 0;
+  while(faixa < FS_HIST_FAIXAS - 1 && us >= (1L << faixa))
+    faixa++;
+  CONTA(estat.ops[op], 1);
+  CONTA(estat.tempo_ns[op], ns);
+  CONTA(estat.hist[op][faixa], 1);
+}
+
+/* Setores ocupados pelas estruturas no disco */
+#define SETORES_DIR (SIZE_DIR * sizeof(dir_entry) / SECTORSIZE)
+#define SETOR_FAT (super.agrup_fat * setores_agrup)
+#define SETOR_DIR (super.agrup_dir * setores_agrup)
+#define ENTRADAS_SETOR_FAT (SECTORSIZE / sizeof(unsigned int))
+int setores_fat;
+
+/* Setores da FAT e do diretorio alterados em RAM e ainda nao gravados. Os
+ * da FAT tambem entram numa lista quando sujam, para que contar e gravar os
+ * sujos nao percorra a FAT inteira; a lista so e ordenada na gravacao. */
+char *fat_sujo;
+int *fat_sujos;
+int num_fat_sujos;
+char dir_sujo[SETORES_DIR];
+int num_dir_sujos;
+
+static void fat_marca(int setor) {
+  if(fat_sujo[setor])
+    return;
+  fat_sujo[setor] = 1;
+  fat_sujos[num_fat_sujos++] = setor;
+}
+
+static int compara_setor(const void *a, const void *b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+/* Ordena a lista dos setores sujos da FAT, para gravar os consecutivos
+ * juntos */
+static void fat_ordena_sujos() {
+  qsort(fat_sujos, num_fat_sujos, sizeof(int), compara_setor);
+}
+
+/* Desmarca os setores sujos da FAT, ja gravados */
+static void fat_sujos_limpa() {
+  for(int i = 0; i < num_fat_sujos; i++)
+    fat_sujo[fat_sujos[i]] = 0;
+  num_fat_sujos = 0;
+}
+
+/* Alocador: mapa de bits dos agrupamentos livres dentro da imagem (bit 1 =
+ * livre), quantos estao livres e a dica de onde continuar a busca. O mapa e
+ * preenchido aos poucos: cada pagina da FAT entra nele na primeira vez que e
+ * lida, e agrup_livres so conta as paginas ja vistas. */
+#define AGRUP_PRIMEIRO_DADO ((int) super.primeiro_dado)
+unsigned int *mapa_livres;
+int agrup_livres;
+int agrup_limite;
+int prox_livre;
+
+/* Extensoes: uma nova extensao reserva (sem garantia) JANELA_EXT agrupamentos
+ * para o proprio arquivo; buscas por espaco contiguo vao ate EXT_MAXIMA */
+#define JANELA_EXT 16
+#define EXT_MAXIMA 256
+int falha_sequencia;
+
+static void mapa_marca(int agrup, int livre) {
+  if(agrup < AGRUP_PRIMEIRO_DADO || agrup >= agrup_limite)
+    return;
+
+  unsigned int bit = 1u << (agrup % 32);
+  if(livre && !(mapa_livres[agrup / 32] & bit))
   {
-    if(fat[i] != AGRUP_FAT)
-    {
-        printf("Erro no carregamento da FAT. Disco nao esta formatado!\n");
-        return 1;
-    }
+    mapa_livres[agrup / 32] |= bit;
+    agrup_livres++;
+    falha_sequencia = 0;
   }
-  if(fat[32] != AGRUP_DIR)
+  else if(!livre && (mapa_livres[agrup / 32] & bit))
   {
-      printf("Erro no carregamento do FAT. Disco nao esta formatado!\n");
-      return 1;
+    mapa_livres[agrup / 32] &= ~bit;
+    agrup_livres--;
   }
+}
 
-  //Carregando Diretório
-  for(int sector = 0; sector < 8; sector++)
-  {
-    char buffer[SECTORSIZE];
+/* FAT paginada, com trava_meta: so as paginas em uso ficam em RAM, ate
+ * fat_orcamento delas. Como os nos dos diretorios, paginas com setores sujos
+ * ficam ate a proxima confirmacao; so paginas limpas sao descartadas, e o
+ * cache passa do orcamento se nenhuma estiver limpa. */
+#define FAT_PAGINA 4096
+#define ENTRADAS_PAGINA (FAT_PAGINA / sizeof(unsigned int))
+#define SETORES_PAGINA (FAT_PAGINA / SECTORSIZE)
 
-    if(!bl_read(sector + 32*8, buffer)){
-        printf("Erro no carregamento da Diretorio. Disco nao esta formatado!\n");
-        return 0;
-    }
-    memcpy(((char*) dir)+sector*SECTORSIZE, buffer, SECTORSIZE);
+typedef struct {
+  int pagina;          //-1: posicao livre
+  unsigned int uso;
+  unsigned int *entradas;
+} pagina_fat;
 
-  }
+pagina_fat *fat_cache;
+int fat_cap;
+int fat_orcamento = FS_FAT_PAGINAS_PADRAO;
+unsigned int fat_relogio;
+int paginas_fat;
+int *fat_posicao;      //Posicao de cada pagina no cache, -1 fora dele
+char *pagina_vista;    //Se a pagina ja entrou no mapa de livres
+int paginas_vistas;
 
-  for(int i = 0 ; i < SIZE_DIR ; i++)
-      if(dir[i].used == 'T')
-        arquivos[i].estado = ARQ_FECHADO;
+static int pagina_suja(int pagina) {
+  for(int s = pagina * SETORES_PAGINA; s < (pagina + 1) * (int) SETORES_PAGINA && s < setores_fat; s++)
+    if(fat_sujo[s])
+      return 1;
+  return 0;
+}
 
-  return 1;
+/* Descarta o cache da FAT */
+static void fat_limpa() {
+  for(int i = 0; i < fat_cap; i++)
+    free(fat_cache[i].entradas);
+  free(fat_cache);
+  fat_cache = NULL;
+  fat_cap = 0;
 }
 
-int fs_format() {
+/* Posicao livre no cache: uma nova ate o orcamento, depois a pagina limpa
+ * usada ha mais tempo, ou uma nova se todas estiverem sujas */
+static int fat_vitima() {
+  int vitima = -1;
 
-  //Inicializando estruturas em RAM
-  //FAT
-  for(int i = 0; i < 32; i++)
+  if(fat_cap >= fat_orcamento)
   {
-    fat[i] = AGRUP_FAT;
+    for(int i = 0; i < fat_cap; i++)
+      if(fat_cache[i].pagina == -1 ||
+         (!pagina_suja(fat_cache[i].pagina) &&
+          (vitima == -1 || fat_cache[i].uso < fat_cache[vitima].uso)))
+      {
+        vitima = i;
+        if(fat_cache[i].pagina == -1)
+          break;
+      }
   }
-  fat[32] = AGRUP_DIR;
-  for(int i = 33; i < SIZE_FAT; i++)
+  if(vitima != -1)
   {
-    fat[i] = AGRUP_LIVRE;
+    if(fat_cache[vitima].pagina != -1)
+      fat_posicao[fat_cache[vitima].pagina] = -1;
+    return vitima;
   }
 
-  //Diretório
-  for(int i = 0; i < 128; i++)
+  pagina_fat *novo = realloc(fat_cache, (fat_cap + 1) * sizeof(pagina_fat));
+  if(novo == NULL)
+    return -1;
+  fat_cache = novo;
+  fat_cache[fat_cap].entradas = malloc(FAT_PAGINA);
+  if(fat_cache[fat_cap].entradas == NULL)
+    return -1;
+  return fat_cap++;
+}
+
+/* Entradas da pagina da FAT, lidas do disco se preciso (NULL em erro). Na
+ * primeira leitura os agrupamentos livres dela entram no mapa. */
+static unsigned int *fat_pagina(int pagina) {
+  int i = fat_posicao[pagina];
+
+  if(i != -1)
   {
-    dir[i].used = 'F';
-    dir[i].name[0] = '\0';
+    fat_cache[i].uso = ++fat_relogio;
+    return fat_cache[i].entradas;
   }
 
-  //Escrevendo no arquivo
-  //FAT
-  for(int agrupamento = 0; agrupamento < 32; agrupamento++)
+  i = fat_vitima();
+  if(i == -1)
   {
-    for(int sector = 0; sector < 8; sector++)
-    {
-      char buffer[SECTORSIZE];
-      memcpy(buffer, ((char*) fat)+((agrupamento*8 + sector)*SECTORSIZE), SECTORSIZE);
-      bl_write((agrupamento*8 + sector), buffer);
-    }
+    printf("Erro: Memoria insuficiente para a FAT!\n");
+    return NULL;
   }
+  fat_cache[i].pagina = -1;
 
-  //Diretório
-  for(int sector = 0; sector < 8; sector++)
+  int setores = setores_fat - pagina * SETORES_PAGINA;
+  if(setores > (int) SETORES_PAGINA)
+    setores = SETORES_PAGINA;
+  memset(fat_cache[i].entradas, 0, FAT_PAGINA);
+  if(!bl_read_range(SETOR_FAT + pagina * SETORES_PAGINA, setores, (char*) fat_cache[i].entradas))
   {
-    char buffer[SECTORSIZE];
-    memcpy(buffer, ((char*) dir)+sector*SECTORSIZE, SECTORSIZE);
-    bl_write(sector + 32*8, buffer);
+    printf("Erro: Falha lendo a FAT do disco!\n");
+    return NULL;
+  }
+  CONTA(estat.fat_paginas_lidas, 1);
+
+  //Setores zerados nao foram gravados desde a formatacao: todas as entradas
+  //deles sao livres. Um setor gravado nunca e todo zero, ja que tem ao menos
+  //uma entrada de agrupamento do disco e 0 nao e valor de entrada.
+  for(int s = 0; s < setores; s++)
+  {
+    unsigned int *e = fat_cache[i].entradas + s * ENTRADAS_SETOR_FAT;
+    unsigned int k = 0;
+    while(k < ENTRADAS_SETOR_FAT && e[k] == 0)
+      k++;
+    if(k < ENTRADAS_SETOR_FAT)
+      continue;
+    int primeiro = pagina * ENTRADAS_PAGINA + s * ENTRADAS_SETOR_FAT;
+    for(k = 0; k < ENTRADAS_SETOR_FAT; k++)
+      e[k] = primeiro + k < super.num_agrups ? AGRUP_LIVRE : 0;
+  }
 
+  fat_cache[i].pagina = pagina;
+  fat_cache[i].uso = ++fat_relogio;
+  fat_posicao[pagina] = i;
+
+  if(!pagina_vista[pagina])
+  {
+    int primeiro = pagina * ENTRADAS_PAGINA;
+    for(int k = 0; k < (int) ENTRADAS_PAGINA; k++)
+      if(fat_cache[i].entradas[k] == AGRUP_LIVRE)
+        mapa_marca(primeiro + k, 1);
+    CONTA(estat.fat_varridas, ENTRADAS_PAGINA);
+    pagina_vista[pagina] = 1;
+    paginas_vistas++;
   }
+  return fat_cache[i].entradas;
+}
+
+/* Proximo agrupamento da cadeia em prox; 0 se a pagina da FAT nao puder
+ * ser carregada */
+static int fat_get(int agrup, unsigned int *prox) {
+  unsigned int *e = fat_pagina(agrup / ENTRADAS_PAGINA);
 
+  if(e == NULL)
+    return 0;
+  *prox = e[agrup % ENTRADAS_PAGINA];
   return 1;
 }
 
-int fs_free() {
-  int agrupOcup = 0;
+/* Conteudo do setor s da FAT, que esta em RAM por estar sujo */
+static char *fat_setor(int s) {
+  return (char*) fat_pagina(s / SETORES_PAGINA) + (s % SETORES_PAGINA) * SECTORSIZE;
+}
+
+/* Agrupamentos liberados desde a ultima confirmacao. Com fs_descarte_config,
+ * os que continuarem livres viram buracos na imagem depois dela, quando a
+ * liberacao ja esta no disco. */
+typedef struct {
+  int agrup;
+  int tam;
+} Faixa;
+
+int descarte_ativo;
+Faixa *descartes;
+int num_descartes;
+int cap_descartes;
+
+static void descarte_anota(int agrup) {
+  Faixa *ult = num_descartes > 0 ? &descartes[num_descartes - 1] : NULL;
 
-  //Contando os espaços livres da FAT
-  for (int i = 0; i < SIZE_FAT; i++)
+  if(ult != NULL && ult->agrup + ult->tam == agrup)
+  {
+    ult->tam++;
+    return;
+  }
+  if(num_descartes == cap_descartes)
   {
+    int cap = cap_descartes ? 2 * cap_descartes : 64;
+    Faixa *f = realloc(descartes, cap * sizeof(Faixa));
+    //Sem memoria, o agrupamento so deixa de virar buraco
+    if(f == NULL)
+      return;
+    descartes = f;
+    cap_descartes = cap;
+  }
+  descartes[num_descartes].agrup = agrup;
+  descartes[num_descartes].tam = 1;
+  num_descartes++;
+}
+
+/* Altera uma entrada da FAT marcando o setor correspondente como sujo; 0 se
+ * a pagina da FAT nao puder ser carregada */
+static int fat_set(int agrup, unsigned int valor) {
+  unsigned int *e = fat_pagina(agrup / ENTRADAS_PAGINA);
+
+  if(e == NULL)
+    return 0;
+  e[agrup % ENTRADAS_PAGINA] = valor;
+  fat_marca(agrup / ENTRADAS_SETOR_FAT);
+  mapa_marca(agrup, valor == AGRUP_LIVRE);
+  if(valor == AGRUP_LIVRE && descarte_ativo)
+    descarte_anota(agrup);
+  return 1;
+}
 
-    if(fat[i] != AGRUP_LIVRE)
+/* Descarta as faixas anotadas, pulando os agrupamentos realocados depois
+ * de liberados; com trava_meta, para nenhum ser alocado no meio */
+static void descarta_liberados() {
+  for(int i = 0; i < num_descartes; i++)
+  {
+    int fim = descartes[i].agrup + descartes[i].tam;
+    for(int a = descartes[i].agrup; a < fim; )
     {
-      agrupOcup++;
+      //Uma pagina que nao pode ser lida so deixa de ser descartada
+      unsigned int valor;
+      int b = a;
+      while(b < fim && fat_get(b, &valor) && valor == AGRUP_LIVRE)
+        b++;
+      if(b > a)
+        bl_discard(a * setores_agrup, (b - a) * setores_agrup);
+      a = b + 1;
     }
   }
+  num_descartes = 0;
+}
 
-  //Multiplicando para tranformar os clusters em bytes
-  return (bl_size()-agrupOcup* 8)*SECTORSIZE;
+/* Palavra p do mapa de livres, lendo antes a pagina da FAT que a cobre se
+ * ela ainda nao entrou no mapa */
+static unsigned int mapa_palavra(int p) {
+  int pagina = p * 32 / ENTRADAS_PAGINA;
+
+  if(!pagina_vista[pagina])
+    fat_pagina(pagina);
+  return mapa_livres[p];
 }
 
-int fs_list(char *buffer, int size) {
-  buffer[0] = '\0';
-  char aux[31];
+/* Diz se ha pelo menos n agrupamentos livres, lendo paginas ainda nao vistas
+ * da FAT so enquanto as ja vistas nao bastarem. As paginas antes da regiao
+ * de dados so tem agrupamentos reservados. */
+static int livres_ao_menos(long long n) {
+  int p = AGRUP_PRIMEIRO_DADO / ENTRADAS_PAGINA;
+  for(; agrup_livres < n && paginas_vistas < paginas_fat && p < paginas_fat; p++)
+    if(!pagina_vista[p] && fat_pagina(p) == NULL)
+      return 0;
+  return agrup_livres >= n;
+}
+
+/* Esvazia o cache e o mapa de livres, que volta a ser preenchido conforme a
+ * FAT for lida */
+static void monta_alocador() {
+  agrup_limite = bl_size() / setores_agrup;
+  if(agrup_limite > (int) super.num_agrups)
+    agrup_limite = super.num_agrups;
+
+  for(int i = 0; i < fat_cap; i++)
+    fat_cache[i].pagina = -1;
+  memset(fat_posicao, -1, paginas_fat * sizeof(int));
+  memset(pagina_vista, 0, paginas_fat);
+  paginas_vistas = 0;
+  memset(mapa_livres, 0, (super.num_agrups + 31) / 32 * sizeof(unsigned int));
+  agrup_livres = 0;
+  prox_livre = AGRUP_PRIMEIRO_DADO;
+  falha_sequencia = 0;
+  num_descartes = 0;
+}
+
+/* Busca o proximo agrupamento livre a partir da dica (next-fit), olhando 32
+ * agrupamentos por vez. */
+static int proximo_livre() {
+  int palavras = (agrup_limite + 31) / 32;
 
-  for (int i = 0; i < SIZE_DIR; i++)
+  if(prox_livre >= agrup_limite)
+    prox_livre = AGRUP_PRIMEIRO_DADO;
+
+  int p = prox_livre / 32;
+  unsigned int bits = mapa_palavra(p) & (~0u << (prox_livre % 32));
+  int i;
+  for(i = 0; bits == 0 && i < palavras; i++)
   {
-    if(dir[i].used == 'T')
-    {
-      sprintf(aux, "%s\t\t%d\n", dir[i].name, dir[i].size);
-      strcpy( &( buffer[strlen(buffer)] ), aux);
-    }
+    p = (p + 1) % palavras;
+    bits = mapa_palavra(p);
   }
+  CONTA(estat.fat_varridas, (i + 1) * 32);
 
-  return 1;
+  return p*32 + __builtin_ctz(bits);
 }
 
-int fs_create(char* file_name) {
+static int agrup_livre(int agrup) {
+  return agrup >= AGRUP_PRIMEIRO_DADO && agrup < agrup_limite &&
+         (mapa_palavra(agrup / 32) & (1u << (agrup % 32)));
+}
 
-    //Testando tamanho do nome
-    if(strlen(file_name)>24)
-    {
-        printf("Erro: Nome de arquivo muito grande!\n");
-        return 0;
-    }
+/* Busca, a partir da dica, uma sequencia de pelo menos minimo agrupamentos
+ * livres. Lembra o menor tamanho que nao foi encontrado, para nao repetir a
+ * busca ate que algum agrupamento seja liberado. */
+static int busca_sequencia(int minimo) {
+  if(falha_sequencia != 0 && minimo >= falha_sequencia)
+    return -1;
 
-    int entradaDirLivre=-1;
-    //Buscando arquivo no diretorio
-    for (int i = 0; i < SIZE_DIR; i++)
+  for(int volta = 0; volta < 2; volta++)
+  {
+    int i = volta ? AGRUP_PRIMEIRO_DADO : prox_livre;
+    int fim = volta ? prox_livre : agrup_limite;
+    int tam = 0;
+    int inicio = i;
+
+    while(i < fim)
     {
-      if(dir[i].used == 'T' && !strcmp(file_name, dir[i].name))
+      //Palavra inteira ocupada
+      if(i % 32 == 0 && mapa_palavra(i / 32) == 0)
       {
-          printf("Erro: Ja existe um arquivo com esse nome!\n");
-          return 0;
+        tam = 0;
+        i += 32;
+        continue;
       }
-      else if(dir[i].used == 'F' && entradaDirLivre == -1 )
+      if(mapa_palavra(i / 32) & (1u << (i % 32)))
       {
-          entradaDirLivre = i;
+        if(++tam >= minimo)
+        {
+          CONTA(estat.fat_varridas, i + 1 - inicio);
+          return i - tam + 1;
+        }
       }
-
+      else
+      {
+        tam = 0;
+      }
+      i++;
     }
+    CONTA(estat.fat_varridas, fim - inicio);
+  }
 
-    if(entradaDirLivre == -1) {
-        printf("Erro: Diretorio cheio!\n");
-        return 0;
-    }
+  falha_sequencia = minimo;
+  return -1;
+}
 
-    //Buscando agrupamento livre na FAT
-    int posFat=33;
+/* Aloca uma sequencia contigua de ate desejado agrupamentos, de preferencia
+ * comecando em objetivo (logo apos o fim do arquivo), e a encadeia na FAT.
+ * Sem objetivo, procura uma sequencia que caiba o pedido (ou ao menos
+ * JANELA_EXT agrupamentos) e deixa a dica JANELA_EXT agrupamentos adiante,
+ * reservando espaco para o arquivo crescer sem se misturar com outros.
+ * Retorna o primeiro agrupamento e a quantidade em obtidos, ou -1 se o disco
+ * estiver cheio ou a FAT nao puder ser lida. */
+static int aloca_extensao(int objetivo, int desejado, int *obtidos) {
+  int inicio = -1;
 
-    while(posFat < SIZE_FAT&&fat[posFat]!=AGRUP_LIVRE)
-        posFat++;
+  if(!livres_ao_menos(1))
+    return -1;
 
-    if(posFat==SIZE_FAT)
-    {
-        printf("Erro: Nao ha espaco livre no disco!\n");
-        return 0;
-    }
+  if(agrup_livre(objetivo))
+  {
+    inicio = objetivo;
+  }
+  else
+  {
+    inicio = busca_sequencia(desejado < EXT_MAXIMA ? desejado : EXT_MAXIMA);
+    if(inicio == -1 && desejado > JANELA_EXT)
+      inicio = busca_sequencia(JANELA_EXT);
+    if(inicio == -1)
+      inicio = proximo_livre();
+  }
 
-    //Definindo valores
+  int tam = 1;
+  while(tam < desejado && agrup_livre(inicio + tam))
+    tam++;
 
-    //Diretorio
-    dir[entradaDirLivre].used='T';
-    strncpy(dir[entradaDirLivre].name,file_name,25);
-    dir[entradaDirLivre].first_block=posFat;
-    dir[entradaDirLivre].size=0;
-    // estado do arquivo
-    arquivos[entradaDirLivre].estado=ARQ_FECHADO;
-    //FAT
-    fat[posFat]=AGRUP_ULTIMO;
-
-  //Escrevendo no arquivo
-  //FAT
-  for(int agrupamento = 0; agrupamento < 32; agrupamento++)
+  for(int i = inicio; i < inicio + tam; i++)
   {
-    for(int sector = 0; sector < 8; sector++)
+    if(!fat_set(i, i < inicio + tam - 1 ? i + 1 : AGRUP_ULTIMO))
     {
-      char buffer[SECTORSIZE];
-      memcpy(buffer, ((char*) fat)+((agrupamento*8 + sector)*SECTORSIZE), SECTORSIZE);
-      bl_write((agrupamento*8 + sector), buffer);
+      //Devolvendo os ja encadeados, com as paginas em RAM por estarem sujas
+      while(--i >= inicio)
+        fat_set(i, AGRUP_LIVRE);
+      return -1;
     }
   }
 
-  //Diretório
-  for(int sector = 0; sector < 8; sector++)
-  {
-    char buffer[SECTORSIZE];
-    memcpy(buffer, ((char*) dir)+sector*SECTORSIZE, SECTORSIZE);
-    bl_write(sector + 32*8, buffer);
+  if(inicio != objetivo)
+    prox_livre = inicio + (tam > JANELA_EXT ? tam : JANELA_EXT);
+  else if(inicio + tam > prox_livre)
+    prox_livre = inicio + tam;
 
-  }
+  *obtidos = tam;
+  return inicio;
+}
 
-    return 1;
+/* Aloca um unico agrupamento, marcado como ultimo de uma cadeia */
+static int aloca_agrup() {
+  int obtidos;
+
+  return aloca_extensao(-1, 1, &obtidos);
 }
 
-int fs_remove(char *file_name) {
+/* Espelhos: agrupamento da raiz da arvore do diretorio de cada arquivo de
+ * subdiretorio aberto (0 = espelho livre) e se o registro mudou desde a
+ * ultima vez que foi copiado para a arvore */
+unsigned int espelho_pai[ABERTOS_SUB];
+char espelho_sujo[ABERTOS_SUB];
+int espelho_usos[ABERTOS_SUB];       //Descritores abertos no espelho
 
-  int indice = -1;
-  int i;
-  for(i = 0; i < SIZE_DIR; i++)
-  {
-    //Checando nome e disponibilidade
-    if(dir[i].used == 'T' && !strcmp(file_name, dir[i].name))
-    {
-        indice = dir[i].first_block;
-        break;
-    }
-  }
+static int agrups_do_arquivo(int file) {
+  return dir[file].size / tam_agrup + 1;
+}
 
-  if(indice == -1)
-  {
-    printf("Erro: Arquivo inexistente!\n");
+/* Cadeias orfas: uma cadeia que ja saiu de todo arquivo mas ainda esta
+ * alocada quando acontece uma confirmacao fica anotada no superbloco, e a
+ * montagem termina de libera-la. A posicao 0 e da liberacao em andamento,
+ * que acontece toda com a trava_meta; as demais sao das copias de separa,
+ * alocadas antes de os dados serem copiados sem a trava (sem posicao livre,
+ * a copia segue sem anotacao e uma queda no meio a deixa alocada). */
+static void orfao_poe(int k, unsigned int agrup) {
+  if(super.agrup_orfaos[k] == agrup)
+    return;
+  super.agrup_orfaos[k] = agrup;
+  super_sujo = 1;
+}
 
-    return 0;
-  }
+/* Posicao livre para a copia de separa, ou -1; com trava_meta */
+static int orfao_livre() {
+  for(int k = 1; k < ORFAOS; k++)
+    if(super.agrup_orfaos[k] == 0)
+      return k;
+  return -1;
+}
 
-  //Removendo o arquivo
-  int anterior = indice;
-  while(fat[indice] != AGRUP_ULTIMO)
-  {
-    indice = fat[anterior];
-    fat[anterior] = AGRUP_LIVRE;
-    anterior = indice;
-  }
+static int journal_cheio();
+static int journal_folga(int file);
+
+/* Passo das liberacoes: se os setores pendentes ja enchem o lote, eles sao
+ * confirmados antes de liberar agrup, com o resto da cadeia anotado como
+ * orfao. O chamador tem a trava do arquivo file (ou -1) para escrita. */
+static int libera_passo(unsigned int agrup, int file) {
+  if(!journal_cheio())
+    return 1;
+  orfao_poe(0, agrup);
+  return journal_folga(file);
+}
 
-  fat[indice] = AGRUP_LIVRE;
-  dir[i].used = 'F';
+/* Libera a cadeia a partir de agrup, ate o fim. Em erro da FAT (0) o
+ * restante da cadeia continua alocado. */
+static int libera_cadeia(unsigned int agrup, int file) {
+  int ok = 1;
 
-  //Escrevendo no arquivo
-  //FAT
-  for(int agrupamento = 0; agrupamento < 32; agrupamento++)
+  while(1)
   {
-    for(int sector = 0; sector < 8; sector++)
+    unsigned int prox;
+    if(!libera_passo(agrup, file) || !fat_get(agrup, &prox) || !fat_set(agrup, AGRUP_LIVRE))
     {
-      char buffer[SECTORSIZE];
-      memcpy(buffer, ((char*) fat)+((agrupamento*8 + sector)*SECTORSIZE), SECTORSIZE);
-      bl_write((agrupamento*8 + sector), buffer);
+      ok = 0;
+      break;
     }
+    if(prox == AGRUP_ULTIMO || prox == AGRUP_LIVRE)
+      break;
+    agrup = prox;
   }
+  orfao_poe(0, 0);
+  return ok;
+}
 
-  //Diretório
-  for(int sector = 0; sector < 8; sector++)
-  {
-    char buffer[SECTORSIZE];
-    memcpy(buffer, ((char*) dir)+sector*SECTORSIZE, SECTORSIZE);
-    bl_write(sector + 32*8, buffer);
+/* Indice do diretorio: tabela hash (sondagem linear) do nome do arquivo para
+ * a entrada em dir[], guardando entrada+1 (0 = balde vazio), e pilha das
+ * entradas livres. */
+#define INDICE_TAM (2 * SIZE_DIR)
+short indice_dir[INDICE_TAM];
+short dir_livres[SIZE_DIR];
+int num_dir_livres;
 
-  }
+static unsigned int hash_nome(char *nome) {
+  unsigned int h = 2166136261u;
 
-  return 1;
+  while(*nome)
+    h = (h ^ (unsigned char) *nome++) * 16777619u;
+  return h & (INDICE_TAM - 1);
 }
 
-int fs_open(char *file_name, int mode) {
-  //Testando tamanho do nome
-  if(strlen(file_name)>24)
+/* Retorna a entrada do diretorio com o nome dado, ou -1 */
+static int indice_busca(char *nome) {
+  for(unsigned int b = hash_nome(nome); indice_dir[b] != 0; b = (b + 1) & (INDICE_TAM - 1))
   {
-	printf("Erro: Nome de arquivo muito grande!\n");
-    return -1;
-	}
-	//Buscando arquivo no diretorio
-	int pos=0;
-	while(pos < SIZE_DIR && dir[pos].used == 'T' && strcmp(file_name, dir[pos].name))
-        pos++;
+    CONTA(estat.sondagens_dir, 1);
+    if(!strcmp(dir[indice_dir[b] - 1].name, nome))
+      return indice_dir[b] - 1;
+  }
+  return -1;
+}
 
+static void indice_insere(int entrada) {
+  unsigned int b = hash_nome(dir[entrada].name);
 
-	if(mode == FS_R)
-	{
-		//Leitura
-		if(pos==SIZE_DIR)
-		{
-			printf("Erro: Arquivo %s nao existe!\n", file_name);
-    	return -1;
-		}
+  while(indice_dir[b] != 0)
+    b = (b + 1) & (INDICE_TAM - 1);
+  indice_dir[b] = entrada + 1;
+}
 
-		if(arquivos[pos].estado==ARQ_FECHADO){
-			arquivos[pos].estado = ARQ_ABERTO_LEITURA;
-			arquivos[pos].posAtual = 0;
-		}
-		else
-		{
-			printf("Erro: Arquivo %s ja esta aberto!\n", file_name);
-    	return -1;
-		}
-	}
-	else
-	{
-		//Escrita
-		if(pos==SIZE_DIR)
-		{
-			if(!fs_create(file_name))
-			{
-				return -1;
-			}
+/* Remove a entrada do indice deslocando para tras os elementos seguintes do
+ * mesmo agrupamento de sondagem, sem deixar marcas de remocao */
+static void indice_remove(int entrada) {
+  unsigned int i = hash_nome(dir[entrada].name);
 
-			pos=0;
-			while(pos < SIZE_DIR && dir[pos].used == 'T' && strcmp(file_name, dir[pos].name))
-			         pos++;
+  while(indice_dir[i] != entrada + 1)
+    i = (i + 1) & (INDICE_TAM - 1);
 
-		}
+  unsigned int j = i;
+  while(1)
+  {
+    j = (j + 1) & (INDICE_TAM - 1);
+    if(indice_dir[j] == 0)
+      break;
 
-		if(arquivos[pos].estado==ARQ_FECHADO){
-			arquivos[pos].estado = ARQ_ABERTO_ESCRITA;
-			arquivos[pos].posAtual = 0;
-		}
-		else
-		{
-			printf("Erro: Arquivo %s ja esta aberto!\n", file_name);
-    	return -1;
-		}
-	}
+    //Posicao ideal do elemento em j; fica se estiver entre i (exclusive) e j
+    unsigned int k = hash_nome(dir[indice_dir[j] - 1].name);
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
 
-  return pos;
+    indice_dir[i] = indice_dir[j];
+    i = j;
+  }
+  indice_dir[i] = 0;
 }
 
-int fs_close(int file)  {
-	if(arquivos[file].estado==ARQ_FECHADO){
-		printf("Erro: Arquivo ja esta fechado!\n");
-    	return 0;
-	}
-	else
-	{
-		arquivos[file].estado = ARQ_FECHADO;
-		arquivos[file].posAtual = -1;
-    }
-  return 1;
+/* Reconstroi o indice e a pilha de livres a partir do diretorio em RAM */
+static void monta_indice() {
+  memset(indice_dir, 0, sizeof(indice_dir));
+  num_dir_livres = 0;
+  for(int i = SIZE_DIR - 1; i >= 0; i--)
+  {
+    if(dir[i].used == 'T' || dir[i].used == 'D')
+      indice_insere(i);
+    else
+      dir_livres[num_dir_livres++] = i;
+  }
 }
 
-int fs_write(char *buffer, int size, int file) {
-
-  if(arquivos[file].estado==ARQ_ABERTO_LEITURA)
+/* Marca como sujo o setor que contem a entrada do diretorio, ou o espelho
+ * da entrada de subdiretorio */
+static void dir_marca(int entrada) {
+  if(entrada >= SIZE_DIR)
   {
-      printf("Erro: Arquivo aberto para leitura!\n");
-      return -1;
+    espelho_sujo[entrada - SIZE_DIR] = 1;
+    return;
   }
-  else if(arquivos[file].estado==ARQ_FECHADO){
-      printf("Erro: Arquivo nao foi aberto!\n");
-      return -1;
-  }
-
-  //Verificando se existe espaço no disco para escrita
-  //Calculando tamanho total final do arquivos (em bytes)
-  int tamFinal= dir[file].size + size;
-
-   //Convertendo o tamanho em blocos
-   tamFinal = tamFinal / CLUSTERSIZE;
-
-  int agrupAtual = dir[file].first_block;
-
-  //Pulando agrupamentos ja escritos
-  while (fat[agrupAtual]!=AGRUP_ULTIMO) {
-      agrupAtual=fat[agrupAtual];
-      tamFinal--;
+  //A entrada pode atravessar o limite entre dois setores
+  int ini = entrada * sizeof(dir_entry) / SECTORSIZE;
+  int fim = ((entrada + 1) * sizeof(dir_entry) - 1) / SECTORSIZE;
+  for(int s = ini; s <= fim; s++)
+  {
+    num_dir_sujos += !dir_sujo[s];
+    dir_sujo[s] = 1;
   }
+}
 
-  int agrupFinalOriginal = agrupAtual;
+/* Subdiretorios: as entradas de cada diretorio ficam em uma arvore B ordenada
+ * pelo nome, com um no por agrupamento (cadeia de um agrupamento so na FAT).
+ * A entrada do diretorio no pai aponta para a raiz da arvore, que nunca muda
+ * de agrupamento: ao dividir a raiz o conteudo dela desce para um novo no, e
+ * ao esvaziar ela recebe o conteudo do unico filho.
+ * No disco o no ocupa os primeiros tam_no bytes do agrupamento (ate
+ * NO_TAM_MAX): num e folha, no_max chaves e no_max+1 filhos; em RAM ele e
+ * sempre um no_arvore, com espaco para o maior no. */
+#define NO_TAM_MAX 4096
+#define NO_CAB (2 * sizeof(unsigned short))
+#define NO_CAP ((NO_TAM_MAX - NO_CAB - sizeof(unsigned int)) / (sizeof(dir_entry) + sizeof(unsigned int)) / 2 * 2 - 1)
 
-  //Enquanto houverem agrup. a serem escritos
-  while (tamFinal>0) {
-      //Buscando agrupamento livre na FAT
-      int posFat=33;
+typedef struct {
+  unsigned short num;
+  unsigned short folha;
+  dir_entry chaves[NO_CAP];
+  unsigned int filhos[NO_CAP + 1];
+} no_arvore;
 
-      while(posFat < SIZE_FAT&&fat[posFat]!=AGRUP_LIVRE)
-          posFat++;
+int tam_no;
+int setores_no;
+int no_max;            //Impar, 2 * no_grau - 1
+int no_grau;
 
-      if(posFat==SIZE_FAT)
-      {
-          printf("Erro: Nao ha espaco livre no disco!\n");
-          return -1;
-      }
+/* Copia um nome de entrada (ate 24 caracteres) para um campo de 25 bytes,
+ * sempre terminado mesmo que a origem nao seja */
+static void copia_nome(char *destino, const char *origem) {
+  size_t n = strnlen(origem, 24);
+  memcpy(destino, origem, n);
+  memset(destino + n, 0, 25 - n);
+}
 
-      fat[agrupAtual]=posFat;
-      fat[posFat]=AGRUP_ULTIMO;
-      agrupAtual=posFat;
-      tamFinal--;
-  }
+/* Ajusta o formato dos nos ao tamanho do agrupamento */
+static void no_geometria() {
+  tam_no = tam_agrup < NO_TAM_MAX ? tam_agrup : NO_TAM_MAX;
+  setores_no = tam_no / SECTORSIZE;
+  no_max = (tam_no - NO_CAB - sizeof(unsigned int)) / (sizeof(dir_entry) + sizeof(unsigned int));
+  if(no_max % 2 == 0)
+    no_max--;
+  no_grau = (no_max + 1) / 2;
+}
 
-  //Escrevendo (EFETIVAMENTE) dados no disco
-  //Carregando o primeiro setor a ser escrito
+/* Agrupamentos livres exigidos antes de inserir em uma arvore, para que as
+ * divisoes no caminho ate a folha nunca fiquem sem espaco */
+#define ARVORE_RESERVA 16
 
-  char bufferEscrita[SECTORSIZE];
-  int escrito = 0;
-  int agrup = agrupFinalOriginal;
-  int byteSetor = dir[file].size % SECTORSIZE;
-  int setor = (dir[file].size / SECTORSIZE) % 8;
-
-  //Ler ultimo agrupamento original
-  bl_read(agrup*8 + setor, bufferEscrita);
-
-  do {
-      //Enquanto houver o que escrever e espaço no setor
-      while(escrito < size && byteSetor < SECTORSIZE){
-          bufferEscrita[byteSetor] = buffer[escrito];
-          escrito++;
-          byteSetor++;
-      }
+/* Cache dos nos, com trava_meta. Nos alterados ficam no cache ate a proxima
+ * confirmacao, que os grava junto com a FAT e o diretorio da raiz; so nos
+ * limpos sao descartados, e o cache cresce se todos estiverem sujos. */
+#define NOS_CACHE 64
 
-      //Escrevendo setor
-      bl_write(agrup*8 + setor, bufferEscrita);
+typedef struct {
+  int agrup;           //0: posicao livre
+  char sujo;
+  unsigned int uso;
+  char dados[NO_TAM_MAX];   //Como no disco
+} no_cache;
 
-      //Indexando proximo setor
-      setor++;
-      setor=setor%8;
-      //Se acabou o agrupamento
-      if(setor==0){
-          agrup=fat[agrup];
-      }
-      byteSetor=0;
+no_cache *nos;
+int nos_cap;
+int nos_sujos;
+unsigned int nos_relogio;
 
-  } while(escrito < size);//Enquanto houver dados no Buffer
+static void nos_limpa() {
+  for(int i = 0; i < nos_cap; i++)
+    nos[i].agrup = 0;
+  nos_sujos = 0;
+}
 
-  //Atualizando tamanho do arquivo no diretório
-  dir[file].size+=size;
+/* Posicao do no no cache, ou uma posicao para ele (-1 sem memoria) */
+static int nos_posicao(int agrup, int *achou) {
+  int vitima = -1;
 
-  //Salvando estruturas no disco
-  //Salvando FAT
-  for(int cluster = 0; cluster < 32; cluster++)
+  for(int i = 0; i < nos_cap; i++)
   {
-    for(int sector = 0; sector < 8; sector++)
+    if(nos[i].agrup == agrup)
     {
-      char buffer[SECTORSIZE];
-      memcpy(buffer, ((char*) fat)+((cluster*8 + sector)*SECTORSIZE), SECTORSIZE);
-      bl_write((cluster*8 + sector), buffer);
+      *achou = 1;
+      nos[i].uso = ++nos_relogio;
+      return i;
     }
+    if(!nos[i].sujo && (vitima == -1 || nos[i].agrup == 0 ||
+                        (nos[vitima].agrup != 0 && nos[i].uso < nos[vitima].uso)))
+      vitima = i;
   }
+  *achou = 0;
 
-  //Salvando Diretório
-  for(int sector = 0; sector < 8; sector++)
+  if(vitima == -1)
   {
-    char buffer[SECTORSIZE];
-    memcpy(buffer, ((char*) dir)+sector*SECTORSIZE, SECTORSIZE);
-    bl_write(sector + 32*8, buffer);
-
+    int cap = nos_cap ? 2 * nos_cap : NOS_CACHE;
+    no_cache *novo = realloc(nos, cap * sizeof(no_cache));
+    if(novo == NULL)
+    {
+      printf("Erro: Memoria insuficiente para os diretorios!\n");
+      return -1;
+    }
+    for(int i = nos_cap; i < cap; i++)
+    {
+      novo[i].agrup = 0;
+      novo[i].sujo = 0;
+    }
+    vitima = nos_cap;
+    nos = novo;
+    nos_cap = cap;
   }
-
-  return escrito;
+  nos[vitima].agrup = 0;
+  nos[vitima].uso = ++nos_relogio;
+  return vitima;
 }
 
-int fs_read(char *buffer, int size, int file) {
-  char bufferLeitura[SECTORSIZE];
+/* Copia o no do agrupamento agrup em no */
+static int no_le(int agrup, no_arvore *no) {
+  int achou;
+  int i = nos_posicao(agrup, &achou);
+
+  if(i == -1)
+    return 0;
+  if(!achou)
+  {
+    if(!bl_read_range(agrup * setores_agrup, setores_no, nos[i].dados))
+    {
+      printf("Erro: Falha lendo diretorio do disco!\n");
+      return 0;
+    }
+    nos[i].agrup = agrup;
+  }
+
+  char *d = nos[i].dados;
+  memcpy(no, d, NO_CAB);
+  memcpy(no->chaves, d + NO_CAB, no_max * sizeof(dir_entry));
+  memcpy(no->filhos, d + NO_CAB + no_max * sizeof(dir_entry), (no_max + 1) * sizeof(unsigned int));
+  return 1;
+}
+
+static int no_grava(int agrup, no_arvore *no) {
+  int achou;
+  int i = nos_posicao(agrup, &achou);
+
+  if(i == -1)
+    return 0;
+  char *d = nos[i].dados;
+  memset(d, 0, tam_no);
+  memcpy(d, no, NO_CAB);
+  memcpy(d + NO_CAB, no->chaves, no_max * sizeof(dir_entry));
+  memcpy(d + NO_CAB + no_max * sizeof(dir_entry), no->filhos, (no_max + 1) * sizeof(unsigned int));
+  nos[i].agrup = agrup;
+  if(!nos[i].sujo)
+    nos_sujos++;
+  nos[i].sujo = 1;
+  return 1;
+}
+
+/* Aloca o agrupamento de um novo no vazio */
+static int no_novo(int folha) {
+  no_arvore no;
+  int agrup = aloca_agrup();
+
+  if(agrup == -1)
+  {
+    printf("Erro: Nao ha espaco livre no disco!\n");
+    return -1;
+  }
+  memset(&no, 0, sizeof(no_arvore));
+  no.folha = folha;
+  return no_grava(agrup, &no) ? agrup : -1;
+}
+
+static int no_libera(int agrup) {
+  for(int i = 0; i < nos_cap; i++)
+  {
+    if(nos[i].agrup == agrup)
+    {
+      if(nos[i].sujo)
+        nos_sujos--;
+      nos[i].agrup = 0;
+      nos[i].sujo = 0;
+    }
+  }
+  return fat_set(agrup, AGRUP_LIVRE);
+}
+
+/* Primeira chave do no com nome maior ou igual (ou so maior, com depois) ao
+ * nome dado, por busca binaria */
+static int no_posicao(no_arvore *no, char *nome, int depois) {
+  int ini = 0;
+  int fim = no->num;
+
+  while(ini < fim)
+  {
+    int meio = (ini + fim) / 2;
+    int c = strcmp(no->chaves[meio].name, nome);
+    CONTA(estat.sondagens_dir, 1);
+    if(c < 0 || (depois && c == 0))
+      ini = meio + 1;
+    else
+      fim = meio;
+  }
+  return ini;
+}
+
+/* Busca o nome na arvore de raiz raiz; com substitui, troca a entrada
+ * encontrada por reg, senao copia a entrada em reg */
+static int arvore_busca(int raiz, char *nome, dir_entry *reg, int substitui) {
+  no_arvore no;
+  int agrup = raiz;
+
+  while(no_le(agrup, &no))
+  {
+    int i = no_posicao(&no, nome, 0);
+    if(i < no.num && !strcmp(no.chaves[i].name, nome))
+    {
+      if(!substitui)
+      {
+        *reg = no.chaves[i];
+        return 1;
+      }
+      no.chaves[i] = *reg;
+      return no_grava(agrup, &no);
+    }
+    if(no.folha)
+      return 0;
+    agrup = no.filhos[i];
+  }
+  return 0;
+}
+
+/* Divide o filho i (cheio) do no x, que esta no agrupamento ax */
+static int divide_filho(no_arvore *x, int ax, int i) {
+  no_arvore y;
+  no_arvore z;
+
+  if(!no_le(x->filhos[i], &y))
+    return 0;
+  int az = no_novo(y.folha);
+  if(az == -1)
+    return 0;
+
+  memset(&z, 0, sizeof(no_arvore));
+  z.folha = y.folha;
+  z.num = no_grau - 1;
+  memcpy(z.chaves, y.chaves + no_grau, (no_grau - 1) * sizeof(dir_entry));
+  if(!y.folha)
+    memcpy(z.filhos, y.filhos + no_grau, no_grau * sizeof(unsigned int));
+  y.num = no_grau - 1;
+
+  memmove(x->filhos + i + 2, x->filhos + i + 1, (x->num - i) * sizeof(unsigned int));
+  x->filhos[i + 1] = az;
+  memmove(x->chaves + i + 1, x->chaves + i, (x->num - i) * sizeof(dir_entry));
+  x->chaves[i] = y.chaves[no_grau - 1];
+  x->num++;
+
+  return no_grava(x->filhos[i], &y) && no_grava(az, &z) && no_grava(ax, x);
+}
+
+/* Insere reg na arvore, dividindo os nos cheios no caminho ate a folha */
+static int arvore_insere(int raiz, dir_entry *reg) {
+  no_arvore x;
+  no_arvore filho;
+  int ax = raiz;
+
+  if(!no_le(raiz, &x))
+    return 0;
+  if(x.num == no_max)
+  {
+    int a = no_novo(x.folha);
+    if(a == -1 || !no_grava(a, &x))
+      return 0;
+    memset(&x, 0, sizeof(no_arvore));
+    x.filhos[0] = a;
+    if(!divide_filho(&x, raiz, 0))
+      return 0;
+  }
+
+  while(!x.folha)
+  {
+    int i = no_posicao(&x, reg->name, 0);
+    if(!no_le(x.filhos[i], &filho))
+      return 0;
+    if(filho.num == no_max)
+    {
+      if(!divide_filho(&x, ax, i))
+        return 0;
+      if(strcmp(reg->name, x.chaves[i].name) > 0)
+        i++;
+    }
+    ax = x.filhos[i];
+    if(!no_le(ax, &x))
+      return 0;
+  }
+
+  int i = no_posicao(&x, reg->name, 0);
+  memmove(x.chaves + i + 1, x.chaves + i, (x.num - i) * sizeof(dir_entry));
+  x.chaves[i] = *reg;
+  x.num++;
+  return no_grava(ax, &x);
+}
+
+/* Junta ao filho i de x a chave i e o filho i+1, que e liberado */
+static int junta_filhos(no_arvore *x, int ax, int i) {
+  no_arvore y;
+  no_arvore z;
+
+  if(!no_le(x->filhos[i], &y) || !no_le(x->filhos[i + 1], &z))
+    return 0;
+
+  y.chaves[y.num] = x->chaves[i];
+  memcpy(y.chaves + y.num + 1, z.chaves, z.num * sizeof(dir_entry));
+  if(!y.folha)
+    memcpy(y.filhos + y.num + 1, z.filhos, (z.num + 1) * sizeof(unsigned int));
+  y.num += z.num + 1;
+
+  if(!no_libera(x->filhos[i + 1]))
+    return 0;
+  memmove(x->chaves + i, x->chaves + i + 1, (x->num - i - 1) * sizeof(dir_entry));
+  memmove(x->filhos + i + 1, x->filhos + i + 2, (x->num - i - 1) * sizeof(unsigned int));
+  x->num--;
+  return no_grava(x->filhos[i], &y) && no_grava(ax, x);
+}
+
+/* Garante que o filho i de x tenha mais que o minimo de chaves, emprestando
+ * de um irmao ou juntando com ele. Retorna o filho a seguir (-1 em erro). */
+static int reforca_filho(no_arvore *x, int ax, int i) {
+  no_arvore c;
+  no_arvore s;
+
+  if(!no_le(x->filhos[i], &c))
+    return -1;
+  if(c.num >= no_grau)
+    return i;
+
+  //Emprestando do irmao da esquerda
+  if(i > 0)
+  {
+    if(!no_le(x->filhos[i - 1], &s))
+      return -1;
+    if(s.num >= no_grau)
+    {
+      memmove(c.chaves + 1, c.chaves, c.num * sizeof(dir_entry));
+      if(!c.folha)
+        memmove(c.filhos + 1, c.filhos, (c.num + 1) * sizeof(unsigned int));
+      c.chaves[0] = x->chaves[i - 1];
+      c.filhos[0] = s.filhos[s.num];
+      x->chaves[i - 1] = s.chaves[s.num - 1];
+      s.num--;
+      c.num++;
+      if(!no_grava(x->filhos[i - 1], &s) || !no_grava(x->filhos[i], &c) || !no_grava(ax, x))
+        return -1;
+      return i;
+    }
+  }
+
+  //Emprestando do irmao da direita
+  if(i < x->num)
+  {
+    if(!no_le(x->filhos[i + 1], &s))
+      return -1;
+    if(s.num >= no_grau)
+    {
+      c.chaves[c.num] = x->chaves[i];
+      c.filhos[c.num + 1] = s.filhos[0];
+      x->chaves[i] = s.chaves[0];
+      memmove(s.chaves, s.chaves + 1, (s.num - 1) * sizeof(dir_entry));
+      if(!s.folha)
+        memmove(s.filhos, s.filhos + 1, s.num * sizeof(unsigned int));
+      s.num--;
+      c.num++;
+      if(!no_grava(x->filhos[i + 1], &s) || !no_grava(x->filhos[i], &c) || !no_grava(ax, x))
+        return -1;
+      return i;
+    }
+  }
+
+  //Juntando com um irmao
+  if(i == x->num)
+    i--;
+  return junta_filhos(x, ax, i) ? i : -1;
+}
+
+/* Remove o nome da arvore. Desce uma vez so, reforcando antes cada filho
+ * visitado para que a remocao na folha nunca o deixe abaixo do minimo. */
+static int arvore_remove(int raiz, char *nome) {
+  char alvo[25];
+  no_arvore x;
+  int ax = raiz;
+  int ok = 0;
+
+  copia_nome(alvo, nome);
+  if(!no_le(raiz, &x))
+    return 0;
+
+  while(1)
+  {
+    int i = no_posicao(&x, alvo, 0);
+    int achou = i < x.num && !strcmp(x.chaves[i].name, alvo);
+
+    if(x.folha)
+    {
+      if(achou)
+      {
+        memmove(x.chaves + i, x.chaves + i + 1, (x.num - i - 1) * sizeof(dir_entry));
+        x.num--;
+        ok = no_grava(ax, &x);
+      }
+      break;
+    }
+
+    if(achou)
+    {
+      no_arvore y;
+      no_arvore z;
+
+      //Chave em no interno: troca pela antecessora (ou sucessora), que e
+      //removida da folha em seguida
+      if(!no_le(x.filhos[i], &y) || !no_le(x.filhos[i + 1], &z))
+        break;
+      if(y.num >= no_grau || z.num >= no_grau)
+      {
+        int esquerda = y.num >= no_grau;
+        no_arvore *f = esquerda ? &y : &z;
+
+        while(!f->folha)
+          if(!no_le(f->filhos[esquerda ? f->num : 0], f))
+            return 0;
+        x.chaves[i] = f->chaves[esquerda ? f->num - 1 : 0];
+        copia_nome(alvo, x.chaves[i].name);
+        if(!no_grava(ax, &x))
+          break;
+        ax = x.filhos[esquerda ? i : i + 1];
+        if(!no_le(ax, &x))
+          break;
+        continue;
+      }
+      //Os dois filhos no minimo: a chave desce com a juncao
+      if(!junta_filhos(&x, ax, i))
+        break;
+      ax = x.filhos[i];
+      if(!no_le(ax, &x))
+        break;
+      continue;
+    }
+
+    i = reforca_filho(&x, ax, i);
+    if(i == -1)
+      break;
+    ax = x.filhos[i];
+    if(!no_le(ax, &x))
+      break;
+  }
+
+  //Raiz vazia com um filho so: o filho sobe para o agrupamento da raiz
+  if(no_le(raiz, &x) && x.num == 0 && !x.folha)
+  {
+    int filho = x.filhos[0];
+    if(!no_le(filho, &x) || !no_grava(raiz, &x) || !no_libera(filho))
+      return 0;
+  }
+  return ok;
+}
+
+/* Percorre em ordem as entradas da arvore com nome maior que apos, ate
+ * visita retornar 0. Retorna 1 se chegou ao fim, 0 se parou e -1 em erro. */
+static int arvore_percorre(int agrup, char *apos, int (*visita)(dir_entry*, void*), void *ctx) {
+  no_arvore no;
+
+  if(!no_le(agrup, &no))
+    return -1;
+  for(int i = no_posicao(&no, apos, 1); i <= no.num; i++)
+  {
+    if(!no.folha)
+    {
+      int r = arvore_percorre(no.filhos[i], apos, visita, ctx);
+      if(r != 1)
+        return r;
+    }
+    if(i < no.num && !visita(&no.chaves[i], ctx))
+      return 0;
+  }
+  return 1;
+}
+
+/* Copia na escrita: um clone comeca dividindo a cadeia inteira da origem, e
+ * a cadeia de um arquivo pode terminar antes da de outro ou emendar nela.
+ * Cada agrupamento tem uma contagem de referencias: as entradas que partem
+ * dele e os agrupamentos que apontam para ele na FAT. Quase todos tem uma
+ * so, e so as contagens maiores ficam guardadas: em RAM numa tabela hash
+ * (sondagem linear) e no disco numa arvore como a dos diretorios, com a
+ * raiz no superbloco e uma entrada 'R' por agrupamento, de nome igual ao
+ * numero dele em hexadecimal e a contagem no tamanho.
+ * Um arquivo so regrava no lugar os agrupamentos que nenhum outro alcanca;
+ * os demais sao copiados e a copia emenda na cadeia antiga depois do trecho
+ * regravado. Crescer no proprio ultimo agrupamento, que clones menores podem
+ * dividir, so e permitido ao arquivo que nao divide nada e ao dono: a origem
+ * de um clone feito quando ela ainda nao dividia nada, que e sempre o maior
+ * dos arquivos com aquele ultimo agrupamento. */
+typedef struct {
+  unsigned int agrup;        //0: balde vazio
+  int refs;
+} Referencia;
+
+#define REFS_MIN 256
+Referencia *refs;
+int refs_cap;                //Potencia de 2
+int num_refs;
+int refs_prontas;            //Se a tabela ja foi montada depois da montagem
+
+static void refs_limpa() {
+  free(refs);
+  refs = NULL;
+  refs_cap = 0;
+  num_refs = 0;
+  refs_prontas = 0;
+}
+
+/* Balde do agrupamento, ou o balde vazio onde ele entraria */
+static Referencia *ref_balde(unsigned int agrup) {
+  unsigned int b = (agrup * 2654435761u) & (refs_cap - 1);
+
+  while(refs[b].agrup != 0 && refs[b].agrup != agrup)
+    b = (b + 1) & (refs_cap - 1);
+  return &refs[b];
+}
+
+/* Referencias ao agrupamento; com trava_meta */
+static int ref_conta(unsigned int agrup) {
+  if(refs_cap == 0)
+    return 1;
+  Referencia *r = ref_balde(agrup);
+  return r->agrup != 0 ? r->refs : 1;
+}
+
+/* Dobra a tabela, reinserindo as contagens */
+static int refs_cresce() {
+  Referencia *antigas = refs;
+  int cap = refs_cap;
+
+  refs_cap = cap ? 2 * cap : REFS_MIN;
+  refs = calloc(refs_cap, sizeof(Referencia));
+  if(refs == NULL)
+  {
+    refs = antigas;
+    refs_cap = cap;
+    printf("Erro: Memoria insuficiente!\n");
+    return 0;
+  }
+  for(int i = 0; i < cap; i++)
+    if(antigas[i].agrup != 0)
+      *ref_balde(antigas[i].agrup) = antigas[i];
+  free(antigas);
+  return 1;
+}
+
+/* Guarda a contagem n do agrupamento na tabela */
+static int ref_poe(unsigned int agrup, int n) {
+  Referencia *r = refs_cap > 0 ? ref_balde(agrup) : NULL;
+
+  if(r == NULL || r->agrup == 0)
+  {
+    if(2 * (num_refs + 1) > refs_cap && !refs_cresce())
+      return 0;
+    r = ref_balde(agrup);
+    r->agrup = agrup;
+    num_refs++;
+  }
+  r->refs = n;
+  return 1;
+}
+
+/* Tira a contagem da tabela, puxando para tras as seguintes da mesma
+ * sequencia de sondagem */
+static void ref_tira(Referencia *r) {
+  unsigned int vazio = r - refs;
+  unsigned int b = vazio;
+
+  r->agrup = 0;
+  num_refs--;
+  while(1)
+  {
+    b = (b + 1) & (refs_cap - 1);
+    if(refs[b].agrup == 0)
+      return;
+    unsigned int ideal = (refs[b].agrup * 2654435761u) & (refs_cap - 1);
+    if(((b - ideal) & (refs_cap - 1)) >= ((b - vazio) & (refs_cap - 1)))
+    {
+      refs[vazio] = refs[b];
+      refs[b].agrup = 0;
+      vazio = b;
+    }
+  }
+}
+
+/* Soma delta as referencias do agrupamento, que continua com pelo menos
+ * uma, na tabela e na arvore; com trava_meta */
+static int ref_soma(unsigned int agrup, int delta) {
+  int atual = ref_conta(agrup);
+  int n = atual + delta;
+  dir_entry reg;
+  int ok = 1;
+
+  if(atual == 1 && 2 * (num_refs + 1) > refs_cap && !refs_cresce())
+    return 0;
+  memset(&reg, 0, sizeof(dir_entry));
+  reg.used = 'R';
+  snprintf(reg.name, sizeof(reg.name), "%08x", agrup);
+  reg.first_block = agrup;
+  reg.size = n;
+  if(n == 1)
+    ok = arvore_remove(super.agrup_refs, reg.name);
+  else if(atual > 1)
+    ok = arvore_busca(super.agrup_refs, reg.name, &reg, 1);
+  else if(!livres_ao_menos(ARVORE_RESERVA))
+    ok = 0;
+  else
+    ok = arvore_insere(super.agrup_refs, &reg);
+  if(!ok)
+  {
+    printf("Erro: Falha atualizando as referencias dos agrupamentos!\n");
+    return 0;
+  }
+  if(n == 1)
+    ref_tira(ref_balde(agrup));
+  else
+    ref_poe(agrup, n);
+  return 1;
+}
+
+/* Solta uma referencia a cadeia que parte de agrup, que ja saiu do arquivo:
+ * os agrupamentos que ficam sem nenhuma sao liberados, ate o primeiro que
+ * ainda tem outra ou o fim da cadeia. Em erro (0) o restante da cadeia
+ * continua alocado. */
+static int solta_cadeia(unsigned int agrup, int file) {
+  int ok = 1;
+
+  while(1)
+  {
+    if(ref_conta(agrup) > 1)
+    {
+      ok = ref_soma(agrup, -1);
+      break;
+    }
+    unsigned int prox;
+    if(!libera_passo(agrup, file) || !fat_get(agrup, &prox) || !fat_set(agrup, AGRUP_LIVRE))
+    {
+      ok = 0;
+      break;
+    }
+    if(prox == AGRUP_ULTIMO || prox == AGRUP_LIVRE)
+      break;
+    agrup = prox;
+  }
+  orfao_poe(0, 0);
+  return ok;
+}
+
+static int visita_refs(dir_entry *reg, void *ctx) {
+  return ref_poe(reg->first_block, reg->size);
+}
+
+/* Monta a tabela de referencias a partir da arvore */
+static int refs_monta() {
+  refs_limpa();
+  return arvore_percorre(super.agrup_refs, "", visita_refs, NULL) == 1;
+}
+
+/* Monta a tabela no primeiro uso, para que montar o disco nao percorra as
+ * arvores; com trava_meta */
+static int refs_carrega() {
+  if(refs_prontas)
+    return 1;
+  if(!refs_monta())
+  {
+    printf("Erro: Falha carregando as referencias dos agrupamentos!\n");
+    return 0;
+  }
+  refs_prontas = 1;
+  return 1;
+}
+
+/* Diz se nenhum dos n primeiros agrupamentos da cadeia que parte de agrup
+ * tem outra referencia; -1 em erro da FAT. Com trava_meta. */
+static int cadeia_exclusiva(unsigned int agrup, int n) {
+  for(int k = 0; num_refs > 0 && k < n; k++)
+  {
+    unsigned int prox;
+    if(ref_conta(agrup) > 1)
+      return 0;
+    if(k == n - 1)
+      break;
+    if(!fat_get(agrup, &prox))
+      return -1;
+    if(prox == AGRUP_ULTIMO)
+      break;
+    agrup = prox;
+  }
+  return 1;
+}
+
+/* Diz se o arquivo pode crescer no proprio ultimo agrupamento: se nenhum
+ * outro alcanca a cadeia dele ou se ele e o dono. Com a trava do arquivo. */
+static int pode_estender(int file) {
+  return arquivos[file].compartilhado >= agrups_do_arquivo(file) || dir[file].dono;
+}
+
+/* Copia para as arvores os registros alterados dos arquivos de
+ * subdiretorios abertos; com trava_meta */
+static int sincroniza_espelhos() {
+  for(int k = 0; k < ABERTOS_SUB; k++)
+  {
+    if(espelho_pai[k] == 0 || !espelho_sujo[k])
+      continue;
+    if(!arvore_busca(espelho_pai[k], dir[SIZE_DIR + k].name, &dir[SIZE_DIR + k], 1))
+    {
+      printf("Erro: Falha atualizando o diretorio!\n");
+      return 0;
+    }
+    espelho_sujo[k] = 0;
+  }
+  return 1;
+}
+
+/* Grava no lugar os nos alterados, zerando as marcas */
+static int grava_nos() {
+  for(int i = 0; i < nos_cap; i++)
+  {
+    if(!nos[i].sujo)
+      continue;
+    if(!bl_write_range(nos[i].agrup * setores_agrup, setores_no, nos[i].dados))
+    {
+      printf("Erro: Falha gravando metadados no disco!\n");
+      return 0;
+    }
+    nos[i].sujo = 0;
+    nos_sujos--;
+  }
+  return 1;
+}
+
+/* Grava os setores sujos de uma estrutura, zerando as marcas gravadas.
+ * Setores sujos consecutivos sao gravados em uma unica operacao. */
+static int grava_sujos(char *estrutura, char *sujo, int setores, int inicio) {
+  int sector = 0;
+
+  while(sector < setores)
+  {
+    if(!sujo[sector])
+    {
+      sector++;
+      continue;
+    }
+
+    int fim = sector;
+    while(fim < setores && sujo[fim])
+      fim++;
+
+    if(!bl_write_range(inicio + sector, fim - sector, estrutura + sector*SECTORSIZE))
+    {
+      printf("Erro: Falha gravando metadados no disco!\n");
+      return 0;
+    }
+    memset(sujo + sector, 0, fim - sector);
+    sector = fim;
+  }
+  return 1;
+}
+
+/* Passa a visita cada trecho sujo da FAT, em ordem e sem atravessar uma
+ * pagina: n setores contiguos em origem, com destino a partir de setor. A
+ * lista dos sujos ja esta ordenada. */
+static int fat_trechos(int (*visita)(unsigned int setor, int n, char *origem, void *ctx), void *ctx) {
+  for(int i = 0; i < num_fat_sujos; )
+  {
+    int s = fat_sujos[i];
+    int fim = i + 1;
+    while(fim < num_fat_sujos && fat_sujos[fim] == s + fim - i && fat_sujos[fim] % SETORES_PAGINA != 0)
+      fim++;
+    if(!visita(SETOR_FAT + s, fim - i, fat_setor(s), ctx))
+      return 0;
+    i = fim;
+  }
+  return 1;
+}
+
+static int trecho_aplica(unsigned int setor, int n, char *origem, void *ctx);
+
+/* Grava os setores sujos da FAT, uma operacao por trecho sujo de cada
+ * pagina */
+static int grava_fat() {
+  fat_ordena_sujos();
+  if(!fat_trechos(trecho_aplica, NULL))
+  {
+    printf("Erro: Falha gravando metadados no disco!\n");
+    return 0;
+  }
+  fat_sujos_limpa();
+  return 1;
+}
+
+/* Repassa ao disco os setores alterados da FAT, do diretorio e dos nos dos
+ * subdiretorios */
+static int grava_metadados() {
+  if(!sincroniza_espelhos())
+    return 0;
+
+  //Superbloco, com as cadeias orfas
+  if(super_sujo)
+  {
+    super.crc = crc_super();
+    if(!bl_write(0, (char*) &super))
+    {
+      printf("Erro: Falha gravando metadados no disco!\n");
+      return 0;
+    }
+    super_sujo = 0;
+  }
+
+  //FAT
+  if(!grava_fat())
+    return 0;
+
+  //Diretório
+  if(!grava_sujos((char*) dir, dir_sujo, SETORES_DIR, SETOR_DIR))
+    return 0;
+  num_dir_sujos = 0;
+
+  return grava_nos();
+}
+
+/* Journal de metadados: os agrupamentos logo apos o diretorio guardam a
+ * ultima transacao confirmada. Os primeiros setores sao o cabecalho, com os
+ * setores de destino e o CRC da transacao, quantos a lista precisar (um so
+ * ate 124 registros); os setores seguintes trazem o conteudo novo deles, na
+ * mesma ordem. Uma transacao tem menos de JOURNAL_LOTE setores pendentes
+ * mais o que um trecho de operacao altera entre duas verificacoes: cada
+ * trecho com a trava_meta que altera metadados comeca por journal_folga, e
+ * os lacos que alocam ou liberam cadeias a chamam a cada passo, alocando
+ * ate ALOCA_LOTE agrupamentos por vez. A regiao do journal tem o tamanho
+ * dessa transacao. fs_sync retira a transacao que ja esta no lugar no
+ * disco, para que a montagem seguinte nao a refaca. Sem a regiao do
+ * journal, os metadados sao gravados direto no lugar. */
+#define SETOR_JOURNAL (super.agrup_journal * setores_agrup)
+#define JOURNAL_CAB (4 * sizeof(unsigned int))
+#define JOURNAL_SETORES_CAB(num) ((JOURNAL_CAB + (num) * sizeof(unsigned int) + SECTORSIZE - 1) / SECTORSIZE)
+#define JOURNAL_LOTE 62              //Setores pendentes que forcam a confirmacao
+#define JOURNAL_NOS 64               //Nos alterados por uma operacao, no maximo
+#define JOURNAL_SETORES_OP 24        //Setores da FAT, do diretorio e do
+                                     //superbloco alterados entre verificacoes
+#define ALOCA_LOTE (8 * (int) ENTRADAS_SETOR_FAT)
+#define JOURNAL_MAGICA 0x4C4A5352
+#define JOURNAL_ATRASO_PADRAO 50
+
+typedef struct {
+  unsigned int magica;
+  unsigned int seq;
+  unsigned int num;
+  unsigned int crc;      //Do cabecalho inteiro (com crc 0) seguido dos registros
+  unsigned int setores[];
+} cabecalho_journal;
+
+int journal_ativo;
+unsigned int journal_seq;
+int journal_atraso = JOURNAL_ATRASO_PADRAO;
+int journal_pendentes;        //Operacoes esperando a proxima confirmacao
+struct timespec journal_primeira;
+int journal_cap;              //Registros que cabem na regiao do journal
+cabecalho_journal *journal_cab;
+//Transacoes gravadas no lugar e quantas delas ja passaram por um bl_sync:
+//os registros de uma so podem ser sobrescritos depois disso
+unsigned int journal_aplicadas;
+unsigned int journal_sincronizadas;
+int journal_retirado;         //Se o cabecalho no disco nao tem transacao
+
+static long ms_desde(struct timespec *t) {
+  struct timespec agora;
+
+  clock_gettime(CLOCK_MONOTONIC, &agora);
+  return (agora.tv_sec - t->tv_sec) * 1000 + (agora.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* Registros que cabem na regiao do journal junto com o cabecalho deles */
+static int journal_capacidade() {
+  int setores = super.agrups_journal * setores_agrup;
+  int cap = setores - 1;
+
+  while(cap > 0 && (int) JOURNAL_SETORES_CAB(cap) + cap > setores)
+    cap--;
+  return cap > 0 ? cap : 0;
+}
+
+/* Passa a visita, em ordem, o superbloco e cada trecho sujo da FAT (sem
+ * atravessar uma pagina), do diretorio e dos nos: n setores contiguos em
+ * origem, com destino a partir de setor. A lista dos sujos da FAT ja esta
+ * ordenada. */
+static int journal_trechos(int (*visita)(unsigned int setor, int n, char *origem, void *ctx), void *ctx) {
+  if(super_sujo && !visita(0, 1, (char*) &super, ctx))
+    return 0;
+  if(!fat_trechos(visita, ctx))
+    return 0;
+  for(unsigned int s = 0; s < SETORES_DIR; )
+  {
+    if(!dir_sujo[s])
+    {
+      s++;
+      continue;
+    }
+    unsigned int fim = s + 1;
+    while(fim < SETORES_DIR && dir_sujo[fim])
+      fim++;
+    if(!visita(SETOR_DIR + s, fim - s, (char*) dir + s*SECTORSIZE, ctx))
+      return 0;
+    s = fim;
+  }
+  for(int i = 0; i < nos_cap; i++)
+    if(nos[i].sujo && !visita(nos[i].agrup * setores_agrup, setores_no, nos[i].dados, ctx))
+      return 0;
+  return 1;
+}
+
+/* Acrescenta os setores do trecho a lista do cabecalho; 0 se nao couberem */
+static int trecho_lista(unsigned int setor, int n, char *origem, void *ctx) {
+  if((int) journal_cab->num + n > journal_cap)
+    return 0;
+  for(int k = 0; k < n; k++)
+    journal_cab->setores[journal_cab->num++] = setor + k;
+  return 1;
+}
+
+/* Grava o trecho na regiao do journal, depois dos registros anteriores */
+typedef struct {
+  unsigned int setor;
+  unsigned int crc;
+} Registros;
+
+static int trecho_registra(unsigned int setor, int n, char *origem, void *ctx) {
+  Registros *r = ctx;
+
+  if(!bl_write_range(r->setor, n, origem))
+    return 0;
+  r->crc = crc32c(r->crc, origem, (size_t) n * SECTORSIZE);
+  r->setor += n;
+  return 1;
+}
+
+/* Grava o trecho no lugar */
+static int trecho_aplica(unsigned int setor, int n, char *origem, void *ctx) {
+  return bl_write_range(setor, n, origem);
+}
+
+/* bl_sync, anotando que as transacoes ja gravadas no lugar estao no disco */
+static int sincroniza() {
+  pthread_mutex_lock(&trava_meta);
+  unsigned int aplicadas = journal_aplicadas;
+  pthread_mutex_unlock(&trava_meta);
+
+  if(!bl_sync())
+    return 0;
+  pthread_mutex_lock(&trava_meta);
+  if((int) (aplicadas - journal_sincronizadas) > 0)
+    journal_sincronizadas = aplicadas;
+  pthread_mutex_unlock(&trava_meta);
+  return 1;
+}
+
+/* Grava no journal a transacao listada no cabecalho e a confirma. Os
+ * registros da anterior so sao sobrescritos depois que ela estiver no lugar
+ * no disco; os dados dos arquivos vao na mesma barreira que os registros. */
+static int journal_grava() {
+  cabecalho_journal *cab = journal_cab;
+  int cab_setores = JOURNAL_SETORES_CAB(cab->num);
+  Registros r;
+
+  if(journal_sincronizadas != journal_aplicadas)
+  {
+    if(!bl_sync())
+      return 0;
+    journal_sincronizadas = journal_aplicadas;
+  }
+
+  cab->magica = JOURNAL_MAGICA;
+  cab->seq = ++journal_seq;
+  cab->crc = 0;
+  journal_retirado = 0;
+  memset((char*) cab->setores + cab->num * sizeof(unsigned int), 0,
+         cab_setores * SECTORSIZE - JOURNAL_CAB - cab->num * sizeof(unsigned int));
+  r.setor = SETOR_JOURNAL + cab_setores;
+  r.crc = crc32c(0, cab, cab_setores * SECTORSIZE);
+  if(!journal_trechos(trecho_registra, &r) || !bl_sync())
+    return 0;
+  cab->crc = r.crc;
+  //Ponto de confirmacao
+  return bl_write_range(SETOR_JOURNAL, cab_setores, (char*) cab) && bl_sync();
+}
+
+/* Cabecalho sem registros, mantendo a sequencia, para que nenhuma
+ * transacao seja refeita */
+static int journal_retira() {
+  journal_cab->magica = JOURNAL_MAGICA;
+  journal_cab->seq = journal_seq;
+  journal_cab->num = 0;
+  journal_cab->crc = 0;
+  memset(journal_cab->setores, 0, SECTORSIZE - JOURNAL_CAB);
+  return bl_write(SETOR_JOURNAL, (char*) journal_cab);
+}
+
+/* Retira a transacao do journal se ela ja esta no lugar no disco, depois de
+ * um sincroniza. So fs_sync faz isso, pagando uma gravacao e um bl_sync. */
+static int journal_encerra() {
+  pthread_mutex_lock(&trava_meta);
+  int retirar = journal_ativo && !journal_retirado && journal_sincronizadas == journal_aplicadas;
+  int ok = !retirar || journal_retira();
+  if(retirar && ok)
+    journal_retirado = 1;
+  pthread_mutex_unlock(&trava_meta);
+  return ok && (!retirar || bl_sync());
+}
+
+/* Confirma no journal, numa transacao so, todos os setores sujos da FAT, do
+ * diretorio e dos nos dos subdiretorios e depois os repassa ao disco no
+ * lugar */
+static int journal_confirma() {
+  journal_pendentes = 0;
+  if(!sincroniza_espelhos())
+    return 0;
+
+  journal_cab->num = 0;
+  fat_ordena_sujos();
+  if(super_sujo)
+    super.crc = crc_super();
+  if(!journal_trechos(trecho_lista, NULL))
+  {
+    printf("Erro: Transacao maior que o journal!\n");
+    return 0;
+  }
+  if(journal_cab->num == 0)
+    return 1;
+
+  if(!journal_grava())
+  {
+    printf("Erro: Falha gravando o journal!\n");
+    return 0;
+  }
+  if(!journal_trechos(trecho_aplica, NULL))
+  {
+    printf("Erro: Falha gravando metadados no disco!\n");
+    return 0;
+  }
+  journal_aplicadas++;
+
+  super_sujo = 0;
+  fat_sujos_limpa();
+  memset(dir_sujo, 0, sizeof(dir_sujo));
+  num_dir_sujos = 0;
+  for(int i = 0; i < nos_cap; i++)
+    nos[i].sujo = 0;
+  nos_sujos = 0;
+  return 1;
+}
+
+static int grava_parcial(int file);
+
+/* Grava os setores incompletos dos arquivos abertos para escrita. O chamador
+ * ja tem a trava do arquivo file (ou -1) para escrita; sem espera, os demais
+ * arquivos so entram se a trava estiver livre, para nao inverter a ordem das
+ * travas (fs_sync, sem travas, espera por todos). */
+static int grava_parciais(int file, int espera) {
+  int ok = 1;
+
+  for(int i = 0; i < SIZE_ARQUIVOS; i++)
+  {
+    if(i != file)
+    {
+      if(espera)
+        pthread_rwlock_wrlock(&arquivos[i].trava);
+      else if(pthread_rwlock_trywrlock(&arquivos[i].trava) != 0)
+        continue;
+    }
+    if(arquivos[i].escrita && !grava_parcial(i))
+      ok = 0;
+    if(i != file)
+      pthread_rwlock_unlock(&arquivos[i].trava);
+  }
+  return ok;
+}
+
+/* Setores sujos das estruturas, pelo journal quando houver; com trava_meta */
+static int confirma_metadados() {
+  int ok = journal_ativo ? journal_confirma() : grava_metadados();
+  if(ok && num_descartes > 0 && (journal_ativo || bl_sync()))
+    descarta_liberados();
+  return ok;
+}
+
+/* Grava os setores incompletos e confirma os metadados pendentes */
+static int confirma(int file, int espera) {
+  int ok = grava_parciais(file, espera);
+
+  pthread_mutex_lock(&trava_meta);
+  ok = ok && confirma_metadados();
+  pthread_mutex_unlock(&trava_meta);
+  return ok;
+}
+
+/* Setores que a proxima confirmacao levara ao journal; cada espelho
+ * alterado vai para um no. Com trava_meta. */
+static int journal_sujos() {
+  int sujos = super_sujo + num_fat_sujos + num_dir_sujos;
+
+  for(int k = 0; k < ABERTOS_SUB; k++)
+    sujos += espelho_sujo[k] * setores_no;
+  return sujos + nos_sujos * setores_no;
+}
+
+static int journal_cheio() {
+  return journal_ativo && journal_sujos() >= JOURNAL_LOTE;
+}
+
+/* Chamada com a trava_meta no inicio de cada trecho que altera metadados e
+ * a cada passo dos lacos que alocam ou liberam cadeias: se os setores
+ * pendentes ja enchem o lote, eles sao confirmados ali mesmo, para que
+ * nenhuma transacao passe do journal. O chamador tem a trava do arquivo
+ * file (ou -1) para escrita; os setores incompletos dos demais so sao
+ * gravados se a trava deles estiver livre, como em conclui_operacao. */
+static int journal_folga(int file) {
+  if(!journal_cheio())
+    return 1;
+  int ok = grava_parciais(file, 0) && confirma_metadados();
+  if(!ok)
+    printf("Erro: Falha confirmando os metadados!\n");
+  return ok;
+}
+
+/* Chamada ao fim de cada operacao que altera metadados, sem a trava_meta.
+ * Com o journal, as operacoes se acumulam e sao confirmadas juntas quando a
+ * mais antiga delas espera ha journal_atraso ms (ou quando os setores
+ * pendentes chegam a JOURNAL_LOTE), aqui ou pelo confirmador se nenhuma
+ * operacao chegar ate o prazo; sem ele, os setores alterados vao direto
+ * para o disco. */
+static int conclui_operacao(int file) {
+  int confirmar;
+
+  pthread_mutex_lock(&trava_meta);
+  if(!journal_ativo)
+  {
+    int ok = grava_metadados();
+    pthread_mutex_unlock(&trava_meta);
+    return ok;
+  }
+
+  if(journal_pendentes++ == 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &journal_primeira);
+    pthread_cond_signal(&journal_aviso);
+  }
+
+  confirmar = journal_sujos() >= JOURNAL_LOTE || ms_desde(&journal_primeira) >= journal_atraso;
+  pthread_mutex_unlock(&trava_meta);
+
+  if(confirmar)
+    return confirma(file, 0) && sincroniza();
+  return 1;
+}
+
+/* Thread que confirma as operacoes pendentes quando a mais antiga completa
+ * journal_atraso ms, mesmo que nenhuma outra operacao chegue depois dela */
+static void *confirmador(void *arg) {
+  pthread_mutex_lock(&trava_meta);
+  while(1)
+  {
+    if(!journal_ativo || journal_pendentes == 0)
+    {
+      pthread_cond_wait(&journal_aviso, &trava_meta);
+      continue;
+    }
+    struct timespec prazo = journal_primeira;
+    prazo.tv_sec += journal_atraso / 1000;
+    prazo.tv_nsec += (journal_atraso % 1000) * 1000000L;
+    if(prazo.tv_nsec >= 1000000000L)
+    {
+      prazo.tv_sec++;
+      prazo.tv_nsec -= 1000000000L;
+    }
+    if(ms_desde(&journal_primeira) < journal_atraso &&
+       pthread_cond_timedwait(&journal_aviso, &trava_meta, &prazo) != ETIMEDOUT)
+      continue;
+
+    //Como em fs_sync, sem esperar pelos arquivos ocupados; a trava_dir vem
+    //antes da trava_meta e deixa fs_init e fs_format de fora
+    pthread_mutex_unlock(&trava_meta);
+    pthread_rwlock_rdlock(&trava_dir);
+    pthread_mutex_lock(&trava_meta);
+    int confirmar = journal_ativo && journal_pendentes > 0 && ms_desde(&journal_primeira) >= journal_atraso;
+    pthread_mutex_unlock(&trava_meta);
+    int ok = !confirmar || (confirma(-1, 0) && sincroniza());
+    pthread_rwlock_unlock(&trava_dir);
+    pthread_mutex_lock(&trava_meta);
+
+    //Em erro, nova tentativa depois de mais um prazo
+    if(!ok)
+    {
+      printf("Erro: Falha confirmando o journal no prazo!\n");
+      clock_gettime(CLOCK_MONOTONIC, &journal_primeira);
+    }
+  }
+  return NULL;
+}
+
+/* Refaz a transacao do journal, com o primeiro setor do cabecalho ja lido
+ * em primeiro, se ela estiver completa e nao tiver sido retirada; *refeita
+ * diz se algum setor foi regravado */
+static int journal_recupera(char *primeiro, int *refeita) {
+  cabecalho_journal *cab = (cabecalho_journal*) primeiro;
+
+  *refeita = 0;
+  if(cab->magica != JOURNAL_MAGICA)
+    return 1;
+  journal_seq = cab->seq;
+  if(cab->num == 0 || cab->num > (unsigned int) journal_cap)
+    return 1;
+
+  //Cabecalho e registros de uma vez, ja que o CRC cobre os dois em sequencia
+  int cab_setores = JOURNAL_SETORES_CAB(cab->num);
+  int setores = cab_setores + cab->num;
+  char *t = malloc((long) setores * SECTORSIZE);
+  if(t == NULL)
+  {
+    printf("Erro: Memoria insuficiente para o journal!\n");
+    return 0;
+  }
+  if(!bl_read_range(SETOR_JOURNAL, setores, t))
+  {
+    free(t);
+    return 0;
+  }
+  cab = (cabecalho_journal*) t;
+  unsigned int crc = cab->crc;
+  cab->crc = 0;
+  if(crc32c(0, t, (long) setores * SECTORSIZE) != crc)
+  {
+    free(t);
+    return 1;
+  }
+
+  int ok = 1;
+  for(unsigned int r = 0; ok && r < cab->num; r++)
+    ok = bl_write(cab->setores[r], t + (cab_setores + r) * SECTORSIZE);
+  free(t);
+  *refeita = 1;
+  return ok && bl_sync();
+}
+
+/* Zera o cabecalho do journal, para que nenhuma transacao seja refeita */
+static int journal_limpa() {
+  char vazio[SECTORSIZE];
+
+  memset(vazio, 0, SECTORSIZE);
+  return bl_write(SETOR_JOURNAL, vazio);
+}
+
+/* Somas de verificacao dos dados: o CRC32C de cada setor, numa tabela
+ * indexada pelo numero do setor. A tabela fica em RAM, lida do disco em
+ * paginas de SOMAS_PAGINA setores no primeiro uso e nunca descartada (ela
+ * ocupa menos de 1% da imagem); a conferencia so le a RAM, sem trava. Cada
+ * soma e gravada antes do setor dela, e o setor da tabela vai inteiro para
+ * o disco. trava_somas ordena as gravacoes da tabela, que guarda somas de
+ * varios arquivos, e a carga das paginas.
+ * Cada pagina em RAM traz depois das somas um bit por setor, marcado quando
+ * o setor e conferido ou gravado junto com a soma: nesta montagem, setor e
+ * soma ja foram vistos iguais e a leitura nao refaz o CRC. Toda montagem
+ * comeca sem marcas, e a primeira leitura de cada setor confere a soma. */
+#define SOMAS_SETOR ((int) (SECTORSIZE / sizeof(unsigned int)))
+#define SOMAS_PAGINA 8
+#define SOMAS_ENTRADAS (SOMAS_PAGINA * SOMAS_SETOR)
+#define SOMAS_MARCAS (SOMAS_ENTRADAS / 32)
+#define SETOR_SOMAS (super.agrup_somas * setores_agrup)
+pthread_rwlock_t trava_somas = PTHREAD_RWLOCK_INITIALIZER;
+int somas_formatacao;         //Se as proximas formatacoes reservam a tabela
+unsigned int **somas_paginas; //NULL: pagina ainda nao lida
+int num_paginas_somas;
+
+static void somas_limpa() {
+  for(int p = 0; p < num_paginas_somas; p++)
+    free(somas_paginas[p]);
+  free(somas_paginas);
+  somas_paginas = NULL;
+  num_paginas_somas = 0;
+}
+
+/* Pagina da tabela com a soma do setor, lida do disco se preciso */
+static unsigned int *somas_pagina(int setor) {
+  int p = setor / SOMAS_ENTRADAS;
+  unsigned int *pagina = __atomic_load_n(&somas_paginas[p], __ATOMIC_ACQUIRE);
+
+  if(pagina != NULL)
+    return pagina;
+  pthread_rwlock_wrlock(&trava_somas);
+  pagina = somas_paginas[p];
+  if(pagina == NULL)
+  {
+    //A ultima pagina pode passar do fim da tabela
+    int setores = super.agrups_somas * setores_agrup - p * SOMAS_PAGINA;
+    if(setores > SOMAS_PAGINA)
+      setores = SOMAS_PAGINA;
+    pagina = calloc(SOMAS_ENTRADAS + SOMAS_MARCAS, sizeof(unsigned int));
+    if(pagina == NULL || !bl_read_range(SETOR_SOMAS + p * SOMAS_PAGINA, setores, (char*) pagina))
+    {
+      free(pagina);
+      pagina = NULL;
+      printf("Erro: Falha lendo as somas de verificacao!\n");
+    }
+    else
+      __atomic_store_n(&somas_paginas[p], pagina, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&trava_somas);
+  return pagina;
+}
+
+/* Confere as somas dos n setores a partir de setor, ja lidos em dados,
+ * pulando os ja conferidos. Sem relata, uma soma errada so faz a
+ * conferencia falhar, para quem vai ler o setor de novo. */
+static int somas_confere(int setor, int n, char *dados, int relata) {
+  if(super.agrups_somas == 0)
+    return 1;
+  for(int i = 0; i < n; )
+  {
+    int s = setor + i;
+    int k = s % SOMAS_ENTRADAS;
+    int m = SOMAS_ENTRADAS - k;
+    if(m > n - i)
+      m = n - i;
+
+    unsigned int *somas = somas_pagina(s);
+    if(somas == NULL)
+      return 0;
+    unsigned int *marcas = somas + SOMAS_ENTRADAS;
+    int conferidos = 0;
+    for(int j = 0; j < m; j++)
+    {
+      int e = k + j;
+      unsigned int palavra = __atomic_load_n(&marcas[e / 32], __ATOMIC_RELAXED);
+      //Palavra inteira conferida
+      if(e % 32 == 0 && m - j >= 32 && palavra == ~0u)
+      {
+        j += 31;
+        continue;
+      }
+      unsigned int bit = 1u << (e % 32);
+      if(palavra & bit)
+        continue;
+      if(crc32c(0, dados + (long) (i + j) * SECTORSIZE, SECTORSIZE) !=
+         __atomic_load_n(&somas[e], __ATOMIC_RELAXED))
+      {
+        if(relata)
+        {
+          CONTA(estat.somas_erradas, 1);
+          printf("Erro: Soma de verificacao incorreta no setor %d!\n", s + j);
+        }
+        return 0;
+      }
+      __atomic_fetch_or(&marcas[e / 32], bit, __ATOMIC_RELAXED);
+      conferidos++;
+    }
+    CONTA(estat.somas_conferidas, conferidos);
+    i += m;
+  }
+  return 1;
+}
+
+/* Troca as somas dos n setores a partir de setor pelas do conteudo em dados
+ * e grava os setores da tabela que mudaram; com trava_somas para escrita */
+static int somas_poe(int setor, int n, char *dados) {
+  for(int i = 0; i < n; )
+  {
+    int s = setor + i;
+    int k = s % SOMAS_SETOR;
+    int m = SOMAS_SETOR - k;
+    if(m > n - i)
+      m = n - i;
+
+    //A pagina nao e lida com a trava: quem grava ja a carregou
+    unsigned int *pagina = somas_paginas[s / SOMAS_ENTRADAS];
+    unsigned int *somas = pagina + (s % SOMAS_ENTRADAS - k);
+    for(int j = 0; j < m; j++)
+    {
+      int e = s % SOMAS_ENTRADAS + j;
+      __atomic_store_n(&somas[k + j], crc32c(0, dados + (long) (i + j) * SECTORSIZE, SECTORSIZE),
+                       __ATOMIC_RELAXED);
+      __atomic_fetch_or(&pagina[SOMAS_ENTRADAS + e / 32], 1u << (e % 32), __ATOMIC_RELAXED);
+    }
+    if(!bl_write(SETOR_SOMAS + s / SOMAS_SETOR, (char*) somas))
+      return 0;
+    i += m;
+  }
+  return 1;
+}
+
+/* Carrega as paginas da tabela com as somas dos n setores a partir de setor */
+static int somas_carrega(int setor, int n) {
+  for(int p = setor / SOMAS_ENTRADAS; p <= (setor + n - 1) / SOMAS_ENTRADAS; p++)
+    if(somas_pagina(p * SOMAS_ENTRADAS) == NULL)
+      return 0;
+  return 1;
+}
+
+/* Grava as somas dos n setores a partir de setor, com o conteudo em dados */
+static int somas_grava(int setor, int n, char *dados) {
+  if(super.agrups_somas == 0)
+    return 1;
+  int ok = somas_carrega(setor, n);
+  if(ok)
+  {
+    pthread_rwlock_wrlock(&trava_somas);
+    ok = somas_poe(setor, n, dados);
+    pthread_rwlock_unlock(&trava_somas);
+  }
+  if(!ok)
+    printf("Erro: Falha gravando as somas de verificacao!\n");
+  return ok;
+}
+
+/* Grava um setor de dados que outro arquivo pode estar lendo: o fim de um
+ * arquivo cresce no lugar sobre o setor incompleto que ele divide com
+ * clones menores. A soma e o setor mudam juntos para le_setor. */
+static int grava_setor(int setor, char *dados) {
+  if(super.agrups_somas == 0)
+    return bl_write(setor, dados);
+  int ok = somas_carrega(setor, 1);
+  if(ok)
+  {
+    pthread_rwlock_wrlock(&trava_somas);
+    ok = somas_poe(setor, 1, dados) && bl_write(setor, dados);
+    pthread_rwlock_unlock(&trava_somas);
+  }
+  return ok;
+}
+
+/* Le um setor de dados incompleto de um arquivo, conferindo a soma */
+static int le_setor(int setor, char *buffer) {
+  if(super.agrups_somas == 0)
+    return bl_read(setor, buffer);
+  if(!somas_carrega(setor, 1))
+    return 0;
+  pthread_rwlock_rdlock(&trava_somas);
+  int ok = bl_read(setor, buffer) && somas_confere(setor, 1, buffer, 1);
+  pthread_rwlock_unlock(&trava_somas);
+  return ok;
+}
+
+void fs_journal_config(int atraso_ms) {
+  pthread_once(&travas_iniciadas, inicia_travas);
+  pthread_mutex_lock(&trava_meta);
+  journal_atraso = atraso_ms;
+  pthread_cond_signal(&journal_aviso);
+  pthread_mutex_unlock(&trava_meta);
+}
+
+void fs_descarte_config(int ativo) {
+  pthread_mutex_lock(&trava_meta);
+  descarte_ativo = ativo;
+  if(!ativo)
+    num_descartes = 0;
+  pthread_mutex_unlock(&trava_meta);
+}
+
+void fs_somas_config(int ativo) {
+  pthread_mutex_lock(&trava_meta);
+  somas_formatacao = ativo;
+  pthread_mutex_unlock(&trava_meta);
+}
+
+void fs_fat_config(int paginas) {
+  pthread_mutex_lock(&trava_meta);
+  fat_orcamento = paginas > 0 ? paginas : 1;
+  pthread_mutex_unlock(&trava_meta);
+}
+
+/* Lote de requisicoes assincronas de uma transferencia: os setores inteiros
+ * vao em pedacos de ate AGRUPS_REQ agrupamentos, LOTE_MAX deles em voo */
+#define LOTE_MAX 32
+#define AGRUPS_REQ 16
+
+typedef struct {
+  bl_req reqs[LOTE_MAX];
+  int num;
+  int escrita;
+} Lote;
+
+/* Submete o lote e espera todas as requisicoes dele */
+static int lote_conclui(Lote *lote) {
+  int ok = 1;
+
+  if(lote->num == 0)
+    return 1;
+  bl_submit(lote->reqs, lote->num);
+  for(int i = 0; i < lote->num; i++)
+    ok = bl_wait(&lote->reqs[i]) && ok;
+  for(int i = 0; ok && !lote->escrita && i < lote->num; i++)
+    ok = somas_confere(lote->reqs[i].sector, lote->reqs[i].count, lote->reqs[i].buffer, 1);
+  lote->num = 0;
+  if(!ok)
+    printf("Erro: Falha na transferencia de dados!\n");
+  return ok;
+}
+
+static int lote_adiciona(Lote *lote, int setor, int count, char *buffer) {
+  while(count > 0)
+  {
+    int m = count;
+    if(m > AGRUPS_REQ * setores_agrup)
+      m = AGRUPS_REQ * setores_agrup;
+
+    if(lote->num == LOTE_MAX && !lote_conclui(lote))
+      return 0;
+    bl_req *r = &lote->reqs[lote->num++];
+    memset(r, 0, sizeof(bl_req));
+    r->sector = setor;
+    r->count = m;
+    r->buffer = buffer;
+    r->escrita = lote->escrita;
+    setor += m;
+    buffer += (long) m * SECTORSIZE;
+    count -= m;
+  }
+  return 1;
+}
+
+/* Transfere n bytes entre o buffer e um trecho contiguo da imagem que
+ * comeca no byte disco. Os setores inteiros vao em uma unica operacao, direto
+ * do (ou para o) buffer; nas pontas incompletas a escrita le o setor antes
+ * para preservar os bytes fora do trecho. */
+static int transfere_continuo(long disco, char *buffer, int n, Lote *lote) {
+  int escrita = lote->escrita;
+  char bufferSetor[SECTORSIZE];
+  int setor = disco / SECTORSIZE;
+  int byteSetor = disco % SECTORSIZE;
+  char *mapa = bl_map(setor, (byteSetor + n + SECTORSIZE - 1) / SECTORSIZE);
+
+  //Imagem mapeada em memoria: copia direto, sem buffer intermediario. As
+  //somas sao dos setores inteiros; numa escrita, as pontas incompletas sao
+  //conferidas antes de mudar. Com uma ponta incompleta, que pode ser o fim
+  //de um clone, os setores e as somas mudam juntos, como em grava_setor.
+  if(mapa != NULL)
+  {
+    int setores = (byteSetor + n + SECTORSIZE - 1) / SECTORSIZE;
+    int fimSetor = (byteSetor + n) % SECTORSIZE;
+    char *ultimo = mapa + (long) (setores - 1) * SECTORSIZE;
+    int pontas = super.agrups_somas > 0 && (byteSetor != 0 || fimSetor != 0);
+    int ok;
+
+    if(pontas)
+    {
+      if(!somas_carrega(setor, setores))
+        return 0;
+      if(escrita)
+        pthread_rwlock_wrlock(&trava_somas);
+      else
+        pthread_rwlock_rdlock(&trava_somas);
+    }
+    if(!escrita)
+    {
+      memcpy(buffer, mapa + byteSetor, n);
+      ok = somas_confere(setor, setores, mapa, 1);
+    }
+    else if((byteSetor != 0 && !somas_confere(setor, 1, mapa, 1)) ||
+            (fimSetor != 0 && (setores > 1 || byteSetor == 0) &&
+             !somas_confere(setor + setores - 1, 1, ultimo, 1)))
+      ok = 0;
+    else
+    {
+      memcpy(mapa + byteSetor, buffer, n);
+      ok = pontas ? somas_poe(setor, setores, mapa) : somas_grava(setor, setores, mapa);
+    }
+    if(pontas)
+      pthread_rwlock_unlock(&trava_somas);
+    return ok;
+  }
+
+  //Ponta inicial incompleta
+  if(byteSetor != 0 || n < SECTORSIZE)
+  {
+    int m = SECTORSIZE - byteSetor;
+    if(m > n)
+      m = n;
+
+    if(!le_setor(setor, bufferSetor))
+      return 0;
+    if(escrita)
+    {
+      memcpy(bufferSetor + byteSetor, buffer, m);
+      if(!grava_setor(setor, bufferSetor))
+        return 0;
+    }
+    else
+    {
+      memcpy(buffer, bufferSetor + byteSetor, m);
+    }
+    buffer += m;
+    n -= m;
+    setor++;
+  }
+
+  //Setores inteiros: poucos passam pelo cache, os demais vao no lote
+  int inteiros = n / SECTORSIZE;
+  if(inteiros > 0)
+  {
+    int ok;
+    if(escrita && !somas_grava(setor, inteiros, buffer))
+      return 0;
+    if(inteiros >= BL_RANGE_DIRETO)
+      ok = lote_adiciona(lote, setor, inteiros, buffer);
+    else
+      ok = escrita ? bl_write_range(setor, inteiros, buffer)
+                   : bl_read_range(setor, inteiros, buffer) && somas_confere(setor, inteiros, buffer, 1);
+    if(!ok)
+      return 0;
+    buffer += inteiros * SECTORSIZE;
+    n -= inteiros * SECTORSIZE;
+    setor += inteiros;
+  }
+
+  //Ponta final incompleta
+  if(n > 0)
+  {
+    if(!le_setor(setor, bufferSetor))
+      return 0;
+    if(escrita)
+    {
+      memcpy(bufferSetor, buffer, n);
+      return grava_setor(setor, bufferSetor);
+    }
+    memcpy(buffer, bufferSetor, n);
+  }
+  return 1;
+}
+
+/* Acrescenta ao mapa de extensoes do arquivo tam agrupamentos contiguos a
+ * partir de agrup, emendando na ultima extensao quando for continuacao dela */
+static int ext_adiciona(Arquivo *arq, int agrup, int tam) {
+  Extensao *ult = arq->numExt > 0 ? &arq->ext[arq->numExt - 1] : NULL;
+
+  if(ult != NULL && ult->agrup + ult->tam == agrup)
+  {
+    ult->tam += tam;
+    return 1;
+  }
+
+  //Ordem calculada antes do realloc, que pode mover o mapa
+  int inicio = ult != NULL ? ult->inicio + ult->tam : 0;
+  if(arq->numExt == arq->capExt)
+  {
+    int cap = arq->capExt ? 2 * arq->capExt : 8;
+    Extensao *ext = realloc(arq->ext, cap * sizeof(Extensao));
+    if(ext == NULL)
+    {
+      printf("Erro: Memoria insuficiente para o mapa do arquivo!\n");
+      return 0;
+    }
+    arq->ext = ext;
+    arq->capExt = cap;
+  }
+
+  arq->ext[arq->numExt].agrup = agrup;
+  arq->ext[arq->numExt].inicio = inicio;
+  arq->ext[arq->numExt].tam = tam;
+  arq->numExt++;
+  return 1;
+}
+
+/* Monta o mapa de extensoes percorrendo a cadeia do arquivo uma vez, e
+ * anota onde ela passa a ser compartilhada; com trava_meta */
+static int monta_extensoes(int file) {
+  Arquivo *arq = &arquivos[file];
   int agrup = dir[file].first_block;
-  int tamanho;
+  int n = agrups_do_arquivo(file);
+
+  arq->numExt = 0;
+  arq->extAtual = 0;
+  arq->compartilhado = INT_MAX;
+  if(!refs_carrega())
+    return 0;
+  //A cadeia pode continuar depois do fim, quando for compartilhada com um
+  //clone maior
+  for(int k = 0; k < n; k++)
+  {
+    CONTA(estat.saltos_cadeia, 1);
+    unsigned int prox;
+    if(arq->compartilhado == INT_MAX && ref_conta(agrup) > 1)
+      arq->compartilhado = k;
+    if(!ext_adiciona(arq, agrup, 1) || !fat_get(agrup, &prox))
+      return 0;
+    if(prox == AGRUP_ULTIMO)
+      return 1;
+    agrup = prox;
+  }
+  return 1;
+}
+
+/* Retorna a extensao que contem o agrupamento de ordem indice na cadeia.
+ * Parte do cursor (leitura sequencial) e recorre a busca binaria quando
+ * o indice esta longe dele. */
+static int ext_busca(Arquivo *arq, int *cursor, int indice) {
+  int e = *cursor;
+
+  CONTA(estat.saltos_cadeia, 1);
+  if(e < arq->numExt && arq->ext[e].inicio <= indice)
+  {
+    if(indice < arq->ext[e].inicio + arq->ext[e].tam)
+      return e;
+    if(e + 1 < arq->numExt && indice < arq->ext[e + 1].inicio + arq->ext[e + 1].tam)
+      return *cursor = e + 1;
+  }
+
+  int ini = 0;
+  int fim = arq->numExt - 1;
+  while(ini < fim)
+  {
+    int meio = (ini + fim + 1) / 2;
+    CONTA(estat.saltos_cadeia, 1);
+    if(arq->ext[meio].inicio <= indice)
+      ini = meio;
+    else
+      fim = meio - 1;
+  }
+  return *cursor = ini;
+}
+
+/* Agrupamento que contem o byte pos do arquivo */
+static int agrup_do_byte(int file, int *cursor, int pos) {
+  Arquivo *arq = &arquivos[file];
+  Extensao *x = &arq->ext[ext_busca(arq, cursor, pos / tam_agrup)];
+
+  return x->agrup + pos / tam_agrup - x->inicio;
+}
+
+/* Transfere n bytes entre o buffer e o arquivo a partir do byte pos, com o
+ * cursor dado no mapa de extensoes. Os setores inteiros de todas as
+ * extensoes ficam em voo ao mesmo tempo */
+static int transfere(int file, int *cursor, int pos, char *buffer, int n, int escrita) {
+  Arquivo *arq = &arquivos[file];
+  Lote lote;
+
+  lote.num = 0;
+  lote.escrita = escrita;
+
+  while(n > 0)
+  {
+    Extensao *x = &arq->ext[ext_busca(arq, cursor, pos / tam_agrup)];
+    long fimExt = (long) (x->inicio + x->tam) * tam_agrup;
+    long disco = (long) x->agrup * tam_agrup + pos - (long) x->inicio * tam_agrup;
+    int m = n;
+    if(m > fimExt - pos)
+      m = fimExt - pos;
+
+    if(!transfere_continuo(disco, buffer, m, &lote))
+    {
+      lote_conclui(&lote);
+      return 0;
+    }
+    buffer += m;
+    pos += m;
+    n -= m;
+  }
+  return lote_conclui(&lote);
+}
+
+/* Grava o setor incompleto do fim do arquivo, se houver bytes pendentes */
+static int grava_parcial(int file) {
+  Arquivo *arq = &arquivos[file];
+
+  if(!arq->parcialSujo)
+    return 1;
+  if(!grava_setor(arq->setorParcial, arq->parcial))
+  {
+    printf("Erro: Falha escrevendo dados no disco!\n");
+    return 0;
+  }
+  arq->parcialSujo = 0;
+  return 1;
+}
+
+/* Espera as requisicoes da janela e, com confere, confere as somas dos
+ * setores lidos. Se algo falhou, a janela fica vazia e a leitura e refeita
+ * pelo caminho normal, que relata o erro. */
+static void janela_espera(Janela *j, int confere) {
+  int ok = 1;
+
+  for(int i = 0; i < j->numReqs; i++)
+    ok = bl_wait(&j->reqs[i]) && ok;
+  for(int i = 0; ok && confere && i < j->numReqs; i++)
+    ok = somas_confere(j->reqs[i].sector, j->reqs[i].count, j->reqs[i].buffer, 0);
+  j->numReqs = 0;
+  if(!ok)
+    j->fim = j->ini;
+}
+
+/* Pede ao disco o trecho do arquivo de tam bytes a partir de ini (inicio de
+ * setor), sem esperar. O trecho acaba no fim do arquivo ou antes: no setor
+ * incompleto que so esta no buffer da escrita, ou quando as extensoes sao
+ * tantas que as requisicoes acabam. */
+static void janela_pede(Janela *j, int file, int *cursor, int ini, int tam) {
+  Arquivo *arq = &arquivos[file];
+  int fim = ini + tam;
+  int pos = ini;
+
+  if(fim > dir[file].size)
+    fim = dir[file].size;
+  if(arq->parcialSujo && fim > dir[file].size / SECTORSIZE * SECTORSIZE)
+    fim = dir[file].size / SECTORSIZE * SECTORSIZE;
+  j->ini = ini;
+  j->versao = arq->versao;
+  j->tamanho = dir[file].size;
+  j->numReqs = 0;
+  while(pos < fim && j->numReqs < ANTECIPA_REQS)
+  {
+    Extensao *x = &arq->ext[ext_busca(arq, cursor, pos / tam_agrup)];
+    long fimExt = (long) (x->inicio + x->tam) * tam_agrup;
+    long disco = (long) x->agrup * tam_agrup + pos - (long) x->inicio * tam_agrup;
+    int m = fim - pos;
+    if(m > fimExt - pos)
+      m = fimExt - pos;
+
+    bl_req *r = &j->reqs[j->numReqs++];
+    memset(r, 0, sizeof(bl_req));
+    r->sector = disco / SECTORSIZE;
+    r->count = (m + SECTORSIZE - 1) / SECTORSIZE;
+    r->buffer = j->dados + pos - ini;
+    pos += m;
+  }
+  j->fim = pos;
+  bl_submit(j->reqs, j->numReqs);
+  CONTA(estat.bytes_antecipados, pos - ini);
+}
+
+/* Se a janela tem o byte pos do arquivo, atual. Uma janela de antes de o
+ * arquivo mudar de tamanho e descartada: o setor em que ela acaba pode ter
+ * ganho dados depois dela. */
+static int janela_tem(Janela *j, int file, int pos) {
+  return j->ini <= pos && pos < j->fim && j->versao == arquivos[file].versao &&
+         j->tamanho == dir[file].size;
+}
+
+static int antecipa_cria(Descritor *desc) {
+  Antecipa *ant = calloc(1, sizeof(Antecipa));
+
+  if(ant == NULL)
+    return 0;
+  ant->j[0].dados = malloc(ANTECIPA_MAX);
+  ant->j[1].dados = malloc(ANTECIPA_MAX);
+  if(ant->j[0].dados == NULL || ant->j[1].dados == NULL)
+  {
+    free(ant->j[0].dados);
+    free(ant->j[1].dados);
+    free(ant);
+    return 0;
+  }
+  desc->ant = ant;
+  return 1;
+}
+
+/* Espera o que estiver em voo e libera as janelas do descritor */
+static void antecipa_libera(Descritor *desc) {
+  Antecipa *ant = desc->ant;
+
+  if(ant == NULL)
+    return;
+  for(int i = 0; i < 2; i++)
+  {
+    janela_espera(&ant->j[i], 0);
+    free(ant->j[i].dados);
+  }
+  free(ant);
+  desc->ant = NULL;
+}
+
+/* Leitura de fs_read. Leituras que continuam a anterior passam pelas
+ * janelas: a que contem a posicao atende a leitura e a seguinte ja fica
+ * pedida ao disco, com o dobro do tamanho (ate ANTECIPA_MAX). Um salto
+ * reduz a janela a metade e, abaixo de ANTECIPA_MIN, desliga a antecipacao.
+ * Leituras de ANTECIPA_MIN bytes ou mais, que ja vao em poucas requisicoes
+ * grandes, e imagens mapeadas em memoria vao direto. */
+static int le_antecipando(Descritor *desc, int file, int pos, char *buffer, int n) {
+  int sequencial = pos == desc->proxSeq;
+
+  desc->proxSeq = pos + n;
+  if(!sequencial)
+  {
+    desc->janela /= 2;
+    if(desc->janela < ANTECIPA_MIN)
+      desc->janela = 0;
+  }
+  else if(desc->janela == 0)
+  {
+    desc->janela = ANTECIPA_MIN;
+  }
+  if(desc->janela == 0 || n >= ANTECIPA_MIN || bl_map(0, 1) != NULL ||
+     (desc->ant == NULL && !antecipa_cria(desc)))
+    return transfere(file, &desc->extAtual, pos, buffer, n, 0);
+
+  Antecipa *ant = desc->ant;
+  Janela *j = &ant->j[ant->atual];
+  while(n > 0)
+  {
+    if(!janela_tem(j, file, pos))
+    {
+      Janela *outra = &ant->j[!ant->atual];
+      if(janela_tem(outra, file, pos))
+      {
+        //A janela seguinte ja foi pedida: a atual pode ser reaproveitada
+        ant->atual = !ant->atual;
+        j = outra;
+      }
+      else
+      {
+        //Falta: a janela e lida agora, a partir do setor da posicao
+        janela_espera(j, 0);
+        janela_pede(j, file, &desc->extAtual, pos / SECTORSIZE * SECTORSIZE, desc->janela);
+      }
+      janela_espera(j, 1);
+      if(!janela_tem(j, file, pos))
+        return transfere(file, &desc->extAtual, pos, buffer, n, 0);
+    }
+    else
+    {
+      CONTA(estat.antecipa_acertos, 1);
+    }
+
+    int m = j->fim - pos;
+    if(m > n)
+      m = n;
+    memcpy(buffer, j->dados + pos - j->ini, m);
+    buffer += m;
+    pos += m;
+    n -= m;
+  }
+
+  //Pedindo a janela seguinte, se ela ainda nao estiver a caminho. Ela
+  //comeca no setor em que a atual acaba, que pode estar pela metade.
+  Janela *outra = &ant->j[!ant->atual];
+  if(j->fim < dir[file].size && !janela_tem(outra, file, j->fim))
+  {
+    janela_espera(outra, 0);
+    if(desc->janela < ANTECIPA_MAX)
+      desc->janela *= 2;
+    janela_pede(outra, file, &desc->extAtual, j->fim / SECTORSIZE * SECTORSIZE, desc->janela);
+  }
+  return 1;
+}
+
+/* Aloca as estruturas em RAM do tamanho da geometria do superbloco */
+static int aplica_geometria() {
+  tam_agrup = super.tam_agrup;
+  setores_agrup = tam_agrup / SECTORSIZE;
+  no_geometria();
+  setores_fat = (super.num_agrups + ENTRADAS_SETOR_FAT - 1) / ENTRADAS_SETOR_FAT;
+  paginas_fat = (setores_fat + SETORES_PAGINA - 1) / SETORES_PAGINA;
+
+  fat_limpa();
+  refs_limpa();
+  somas_limpa();
+  free(fat_sujo);
+  free(fat_sujos);
+  free(fat_posicao);
+  free(pagina_vista);
+  free(mapa_livres);
+  free(journal_cab);
+  fat_sujo = calloc(setores_fat + 1, 1);
+  fat_sujos = malloc((setores_fat + 1) * sizeof(int));
+  num_fat_sujos = 0;
+  fat_posicao = calloc(paginas_fat + 1, sizeof(int));
+  pagina_vista = calloc(paginas_fat + 1, 1);
+  mapa_livres = calloc((super.num_agrups + 31) / 32 + 1, sizeof(unsigned int));
+  num_paginas_somas = (super.agrups_somas * setores_agrup + SOMAS_PAGINA - 1) / SOMAS_PAGINA;
+  somas_paginas = calloc(num_paginas_somas + 1, sizeof(unsigned int*));
+  journal_cap = journal_capacidade();
+  journal_cab = malloc(JOURNAL_SETORES_CAB(journal_cap) * SECTORSIZE);
+  if(fat_sujo == NULL || fat_sujos == NULL || fat_posicao == NULL || pagina_vista == NULL ||
+     mapa_livres == NULL || somas_paginas == NULL || journal_cab == NULL)
+  {
+    printf("Erro: Memoria insuficiente para a FAT!\n");
+    memset(&super, 0, sizeof(superbloco));
+    super.tam_agrup = tam_agrup;
+    return 0;
+  }
+  return 1;
+}
+
+/* Se o superbloco lido descreve um disco formatado: FS_MONTADO,
+ * FS_NAO_FORMATADO sem a assinatura ou FS_CORROMPIDO */
+static int geometria_valida() {
+  unsigned int t = super.tam_agrup;
+
+  if(super.magica != SUPER_MAGICA)
+    return FS_NAO_FORMATADO;
+  if(super.versao != SUPER_VERSAO || super.crc != crc_super())
+    return FS_CORROMPIDO;
+  if(t < AGRUP_MIN || t > AGRUP_MAX || (t & (t - 1)) != 0)
+    return FS_CORROMPIDO;
+  if((long long) super.num_agrups * (t / SECTORSIZE) > bl_size())
+    return FS_CORROMPIDO;
+  int somas = super.agrups_somas == 0 ||
+         (super.agrup_somas == super.agrup_journal + super.agrups_journal &&
+          (long long) super.agrups_somas * t >= (long long) super.num_agrups * (t / SECTORSIZE) * sizeof(unsigned int));
+  int ok = somas && super.agrup_fat == 1 &&
+         (long long) super.agrups_fat * t >= (long long) super.num_agrups * sizeof(unsigned int) &&
+         super.agrup_dir == super.agrup_fat + super.agrups_fat &&
+         super.agrups_dir * t >= SETORES_DIR * SECTORSIZE &&
+         super.agrup_journal == super.agrup_dir + super.agrups_dir &&
+         super.primeiro_dado == super.agrup_journal + super.agrups_journal + super.agrups_somas &&
+         super.primeiro_dado < super.num_agrups &&
+         super.agrup_refs >= super.primeiro_dado && super.agrup_refs < super.num_agrups;
+  for(int k = 0; ok && k < ORFAOS; k++)
+    ok = super.agrup_orfaos[k] == 0 ||
+         (super.agrup_orfaos[k] >= super.primeiro_dado && super.agrup_orfaos[k] < super.num_agrups);
+  return ok ? FS_MONTADO : FS_CORROMPIDO;
+}
+
+/* Termina de liberar as cadeias orfas anotadas no superbloco, numa
+ * montagem depois de uma queda; com trava_meta */
+static int libera_orfaos() {
+  int achou = 0;
+
+  for(int k = 0; k < ORFAOS; k++)
+  {
+    unsigned int agrup = super.agrup_orfaos[k];
+    if(agrup == 0)
+      continue;
+    orfao_poe(k, 0);
+    if(!refs_carrega() || !solta_cadeia(agrup, -1))
+      return 0;
+    achou = 1;
+  }
+  return !achou || (journal_confirma() && bl_sync());
+}
+
+/* Fecha todos os arquivos e descritores */
+static void descritores_limpa() {
+  for(int i = 0; i < SIZE_ARQUIVOS; i++)
+  {
+    arquivos[i].abertos = 0;
+    arquivos[i].escrita = 0;
+  }
+  num_descritores_livres = 0;
+  for(int d = NUM_DESCRITORES - 1; d >= 0; d--)
+  {
+    antecipa_libera(&descritores[d]);
+    descritores[d].estado = ARQ_FECHADO;
+    descritores_livres[num_descritores_livres++] = d;
+  }
+}
+
+/* Deixa o sistema vazio, sem disco montado, so podendo ser formatado */
+static void desmonta() {
+  memset(dir, 0, sizeof(dir));
+  memset(&super, 0, sizeof(superbloco));
+  super.tam_agrup = FS_AGRUP_PADRAO;
+  aplica_geometria();
+  monta_alocador();
+  monta_indice();
+  nos_limpa();
+  journal_ativo = 0;
+}
+
+/* Entradas da raiz coerentes com a geometria */
+static int diretorio_valido() {
+  for(int i = 0; i < SIZE_DIR; i++)
+  {
+    dir_entry *e = &dir[i];
+
+    if(e->used == 'F' || e->used == 0)
+      continue;
+    if((e->used != 'T' && e->used != 'D') || e->name[24] != '\0' || e->size < 0 ||
+       e->first_block < super.primeiro_dado || e->first_block >= super.num_agrups)
+      return 0;
+  }
+  return 1;
+}
+
+/* Monta o disco com duas leituras: o superbloco e, de uma vez, o diretorio
+ * e o cabecalho do journal, que vem logo depois dele. A FAT e lida sob
+ * demanda, so nas paginas usadas, e as referencias dos agrupamentos no
+ * primeiro uso. Depois de um fs_sync nada e gravado. */
+static int inicia() {
+  memset(dir, 0, sizeof(dir));
+  descritores_limpa();
+  if(!bl_read(0, (char*) &super))
+  {
+      printf("Erro no carregamento do superbloco!\n");
+      desmonta();
+      return 0;
+  }
+  int estado = geometria_valida();
+  if(estado == FS_NAO_FORMATADO)
+  {
+      printf("Erro no carregamento do superbloco. Disco nao esta formatado!\n");
+      desmonta();
+      return estado;
+  }
+  if(estado == FS_CORROMPIDO)
+  {
+      printf("Erro no carregamento do superbloco. Disco corrompido!\n");
+      desmonta();
+      return estado;
+  }
+  if(!aplica_geometria())
+      return 0;
+
+  int setores = SETOR_JOURNAL + 1 - SETOR_DIR;
+  char *regiao = malloc((long) setores * SECTORSIZE);
+  if(regiao == NULL || !bl_read_range(SETOR_DIR, setores, regiao))
+  {
+      free(regiao);
+      printf("Erro no carregamento do diretorio!\n");
+      desmonta();
+      return 0;
+  }
+  memcpy(dir, regiao, SETORES_DIR * SECTORSIZE);
+
+  //Refazendo a ultima transacao do journal, caso o sistema tenha parado
+  //antes de grava-la no lugar; o diretorio e as cadeias orfas do
+  //superbloco podem ter mudado com ela
+  int refeita;
+  int ok = journal_recupera(regiao + (long) (SETOR_JOURNAL - SETOR_DIR) * SECTORSIZE, &refeita);
+  journal_retirado = !refeita;
+  free(regiao);
+  if(!ok || (refeita && (!bl_read_range(SETOR_DIR, SETORES_DIR, (char*) dir) ||
+                         !bl_read(0, (char*) &super) || geometria_valida() != FS_MONTADO)))
+  {
+      printf("Erro na recuperacao do journal!\n");
+      desmonta();
+      return 0;
+  }
+  if(!diretorio_valido())
+  {
+      printf("Erro no carregamento do diretorio. Disco corrompido!\n");
+      desmonta();
+      return FS_CORROMPIDO;
+  }
+
+  monta_alocador();
+  monta_indice();
+  memset(espelho_pai, 0, sizeof(espelho_pai));
+  nos_limpa();
+
+  journal_ativo = 1;
+  journal_pendentes = 0;
+
+  //Estruturas em RAM identicas ao disco
+  super_sujo = 0;
+  fat_sujos_limpa();
+  memset(dir_sujo, 0, sizeof(dir_sujo));
+  num_dir_sujos = 0;
+
+  if(!libera_orfaos())
+  {
+      printf("Erro liberando as cadeias orfas!\n");
+      desmonta();
+      return 0;
+  }
+
+  return FS_MONTADO;
+}
+
+int fs_init() {
+  struct timespec t;
+  op_inicia(&t);
+  pthread_once(&travas_iniciadas, inicia_travas);
+  pthread_rwlock_wrlock(&trava_dir);
+  pthread_mutex_lock(&trava_meta);
+  int ok = inicia();
+  pthread_mutex_unlock(&trava_meta);
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_INIT, &t);
+  return ok;
+}
+
+/* Escolhe a geometria para agrupamentos de tam bytes: superbloco, FAT,
+ * diretorio e journal, nessa ordem, e os dados no restante da imagem */
+static int calcula_geometria(int tam) {
+  if(tam < AGRUP_MIN || tam > AGRUP_MAX || (tam & (tam - 1)) != 0)
+  {
+    printf("Erro: Tamanho de agrupamento invalido!\n");
+    return 0;
+  }
+
+  memset(&super, 0, sizeof(superbloco));
+  super.magica = SUPER_MAGICA;
+  super.versao = SUPER_VERSAO;
+  super.tam_agrup = tam;
+  super.num_agrups = bl_size() / (tam / SECTORSIZE);
+  super.agrup_fat = 1;
+  super.agrups_fat = ((long long) super.num_agrups * sizeof(unsigned int) + tam - 1) / tam;
+  super.agrup_dir = super.agrup_fat + super.agrups_fat;
+  super.agrups_dir = (SETORES_DIR * SECTORSIZE + tam - 1) / tam;
+  super.agrup_journal = super.agrup_dir + super.agrups_dir;
+  //Journal para a maior transacao: o lote pendente, o que um trecho altera
+  //antes da verificacao seguinte e os nos de mais uma operacao
+  long long registros = JOURNAL_LOTE + JOURNAL_SETORES_OP +
+                        JOURNAL_NOS * ((tam < NO_TAM_MAX ? tam : NO_TAM_MAX) / SECTORSIZE);
+  super.agrups_journal = ((JOURNAL_SETORES_CAB(registros) + registros) * SECTORSIZE + tam - 1) / tam;
+  super.agrup_somas = super.agrup_journal + super.agrups_journal;
+  if(somas_formatacao)
+    super.agrups_somas = ((long long) super.num_agrups * (tam / SECTORSIZE) * sizeof(unsigned int) + tam - 1) / tam;
+  super.primeiro_dado = super.agrup_somas + super.agrups_somas;
+  if(super.primeiro_dado >= super.num_agrups)
+  {
+    printf("Erro: Disco pequeno demais!\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int formata(int tam) {
+  if(!calcula_geometria(tam) || !aplica_geometria())
+    return 0;
+
+  //FAT, gravada direto no disco uma pagina por vez. So as paginas com as
+  //regioes reservadas precisam ser gravadas: o resto da FAT vira um buraco
+  //na imagem, lido como setores zerados (todos livres). Sem suporte a
+  //buracos, a FAT inteira e gravada.
+  int gravadas = (super.primeiro_dado + ENTRADAS_PAGINA - 1) / ENTRADAS_PAGINA;
+  if(gravadas >= paginas_fat ||
+     !bl_discard(SETOR_FAT + gravadas * SETORES_PAGINA, setores_fat - gravadas * SETORES_PAGINA))
+    gravadas = paginas_fat;
+  unsigned int pagina[ENTRADAS_PAGINA];
+  for(int p = 0; p < gravadas; p++)
+  {
+    for(unsigned int k = 0; k < ENTRADAS_PAGINA; k++)
+    {
+      unsigned int i = p * ENTRADAS_PAGINA + k;
+
+      if(i == 0)
+        pagina[k] = AGRUP_SUPER;
+      else if(i < super.agrup_dir)
+        pagina[k] = AGRUP_FAT;
+      else if(i < super.agrup_journal)
+        pagina[k] = AGRUP_DIR;
+      else if(i < super.agrup_somas)
+        pagina[k] = AGRUP_JOURNAL;
+      else if(i < super.primeiro_dado)
+        pagina[k] = AGRUP_SOMAS;
+      else if(i < super.num_agrups)
+        pagina[k] = AGRUP_LIVRE;
+      else
+        pagina[k] = 0;
+    }
+
+    int setores = setores_fat - p * SETORES_PAGINA;
+    if(setores > (int) SETORES_PAGINA)
+      setores = SETORES_PAGINA;
+    if(!bl_write_range(SETOR_FAT + p * SETORES_PAGINA, setores, (char*) pagina))
+      return 0;
+  }
+
+  monta_alocador();
+
+  //Diretório
+  for(int i = 0; i < SIZE_DIR; i++)
+  {
+    memset(&dir[i], 0, sizeof(dir_entry));
+    dir[i].used = 'F';
+  }
+  monta_indice();
+  descritores_limpa();
+  memset(espelho_pai, 0, sizeof(espelho_pai));
+  nos_limpa();
+  refs_limpa();
+
+  //Arvore de referencias vazia, no primeiro agrupamento de dados
+  int raiz = no_novo(1);
+  if(raiz == -1)
+    return 0;
+  super.agrup_refs = raiz;
+  refs_prontas = 1;
+
+  //Escrevendo no arquivo, direto no lugar e com o journal vazio; o
+  //superbloco por ultimo, depois do resto estar no disco
+  memset(dir_sujo, 1, sizeof(dir_sujo));
+  num_dir_sujos = SETORES_DIR;
+  super.crc = crc_super();
+  if(!grava_metadados() || !journal_limpa() || !bl_sync() ||
+     !bl_write(0, (char*) &super) || !bl_sync())
+    return 0;
+  journal_retirado = 1;
+  journal_ativo = 1;
+  journal_pendentes = 0;
+
+  return 1;
+}
+
+int fs_format() {
+  return fs_format_cluster(FS_AGRUP_PADRAO);
+}
+
+int fs_format_cluster(int tam_agrup) {
+  struct timespec t;
+  op_inicia(&t);
+  pthread_once(&travas_iniciadas, inicia_travas);
+  pthread_rwlock_wrlock(&trava_dir);
+  pthread_mutex_lock(&trava_meta);
+  int ok = formata(tam_agrup);
+  pthread_mutex_unlock(&trava_meta);
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_FORMAT, &t);
+  return ok;
+}
+
+int fs_sync() {
+  struct timespec t;
+  op_inicia(&t);
+  //Setores incompletos pendentes nos arquivos abertos para escrita, setores
+  //sujos das estruturas e setores ainda no cache do disco; por fim a
+  //transacao do journal, ja no lugar, e retirada
+  int ok = confirma(-1, 1) && sincroniza() && journal_encerra();
+  op_conclui(FS_OP_SYNC, &t);
+  return ok;
+}
+
+long long fs_free() {
+  //Agrupamentos ocupados dentro da imagem, mantidos pelo alocador; as
+  //paginas da FAT que ele ainda nao viu sao lidas para completar a conta
+  pthread_mutex_lock(&trava_meta);
+  livres_ao_menos(agrup_limite);
+  long long agrupOcup = agrup_limite - agrup_livres;
+  pthread_mutex_unlock(&trava_meta);
+
+  //Multiplicando para tranformar os clusters em bytes
+  return (bl_size()-agrupOcup*setores_agrup)*SECTORSIZE;
+}
+
+/* Listagem da raiz em texto, montada com o iterador */
+int fs_list(char *buffer, int size) {
+  fs_dir d;
+  fs_entrada e;
+  int usado = 0;
+  int r;
+
+  buffer[0] = '\0';
+  if(!fs_opendir(&d, "/"))
+    return 0;
+  while((r = fs_readdir(&d, &e)) == 1)
+  {
+    int n = e.tipo == 'D' ? snprintf(buffer + usado, size - usado, "%s/\n", e.nome)
+                          : snprintf(buffer + usado, size - usado, "%s\t\t%d\n", e.nome, e.tamanho);
+    if(n >= size - usado)
+    {
+      buffer[usado] = '\0';
+      printf("Erro: Listagem maior que o buffer!\n");
+      return 0;
+    }
+    usado += n;
+  }
+  fs_closedir(&d);
+  return r == 0;
+}
+
+/* Local de uma entrada: a tabela da raiz (pai 0) ou a arvore do diretorio
+ * cuja raiz esta no agrupamento pai */
+typedef struct {
+  int pai;
+  char nome[25];
+} Local;
+
+/* Busca a entrada do local e copia o registro em reg; entrada recebe a
+ * entrada da raiz, ou -1 nos subdiretorios. Com trava_dir. */
+static int busca_local(Local *loc, dir_entry *reg, int *entrada) {
+  int achou = 1;
+
+  *entrada = -1;
+  if(loc->pai == 0)
+  {
+    *entrada = indice_busca(loc->nome);
+    if(*entrada == -1)
+      return 0;
+  }
+
+  pthread_mutex_lock(&trava_meta);
+  if(*entrada != -1)
+    *reg = dir[*entrada];
+  else
+    achou = arvore_busca(loc->pai, loc->nome, reg, 0);
+  pthread_mutex_unlock(&trava_meta);
+  return achou;
+}
+
+/* Separa o caminho (nomes separados por '/', a partir da raiz) no diretorio
+ * pai e no nome da entrada; com trava_dir */
+static int resolve(char *caminho, Local *loc) {
+  dir_entry reg;
+  int entrada;
+
+  loc->pai = 0;
+  while(1)
+  {
+    while(*caminho == '/')
+      caminho++;
+    int tam = strcspn(caminho, "/");
+    if(tam == 0)
+    {
+      printf("Erro: Caminho invalido!\n");
+      return 0;
+    }
+    if(tam > 24)
+    {
+      printf("Erro: Nome de arquivo muito grande!\n");
+      return 0;
+    }
+    memcpy(loc->nome, caminho, tam);
+    loc->nome[tam] = '\0';
+    caminho += tam;
+    if(caminho[strspn(caminho, "/")] == '\0')
+      return 1;
+
+    if(!busca_local(loc, &reg, &entrada) || reg.used != 'D')
+    {
+      printf("Erro: Diretorio %s nao existe!\n", loc->nome);
+      return 0;
+    }
+    loc->pai = reg.first_block;
+  }
+}
+
+/* Entrada espelho do arquivo de subdiretorio, ou -1 se ele nao estiver
+ * aberto; com trava_meta */
+static int espelho_busca(Local *loc) {
+  for(int k = 0; k < ABERTOS_SUB; k++)
+    if(espelho_pai[k] == loc->pai && !strcmp(dir[SIZE_DIR + k].name, loc->nome))
+      return SIZE_DIR + k;
+  return -1;
+}
+
+/* Reserva o espelho para abrir o arquivo de subdiretorio do local, ou o
+ * espelho que o arquivo ja tem se estiver aberto */
+static int espelho_novo(Local *loc, char *caminho) {
+  pthread_mutex_lock(&trava_meta);
+  int pos = espelho_busca(loc);
+  if(pos != -1)
+  {
+    espelho_usos[pos - SIZE_DIR]++;
+    pthread_mutex_unlock(&trava_meta);
+    return pos;
+  }
+  for(int k = 0; pos == -1 && k < ABERTOS_SUB; k++)
+    if(espelho_pai[k] == 0)
+      pos = SIZE_DIR + k;
+  if(pos == -1)
+  {
+    pthread_mutex_unlock(&trava_meta);
+    printf("Erro: Arquivos abertos demais!\n");
+    return -1;
+  }
+  if(!arvore_busca(loc->pai, loc->nome, &dir[pos], 0))
+  {
+    pthread_mutex_unlock(&trava_meta);
+    printf("Erro: Arquivo %s nao existe!\n", caminho);
+    return -1;
+  }
+  espelho_pai[pos - SIZE_DIR] = loc->pai;
+  espelho_sujo[pos - SIZE_DIR] = 0;
+  espelho_usos[pos - SIZE_DIR] = 1;
+  pthread_mutex_unlock(&trava_meta);
+  return pos;
+}
+
+/* Solta um uso do espelho. Com o ultimo, o espelho e devolvido, levando o
+ * registro para a arvore */
+static int espelho_solta(int pos) {
+  pthread_mutex_lock(&trava_meta);
+  if(--espelho_usos[pos - SIZE_DIR] > 0)
+  {
+    pthread_mutex_unlock(&trava_meta);
+    return 1;
+  }
+  int ok = sincroniza_espelhos();
+  espelho_pai[pos - SIZE_DIR] = 0;
+  pthread_mutex_unlock(&trava_meta);
+  return ok;
+}
+
+/* Acrescenta reg ao diretorio do local, com o nome do local. Retorna a
+ * entrada usada na raiz, SIZE_ARQUIVOS nos subdiretorios ou -1; com a
+ * trava_dir para escrita e a trava_meta */
+static int insere_local(Local *loc, dir_entry *reg) {
+  copia_nome(reg->name, loc->nome);
+  if(loc->pai != 0)
+    return arvore_insere(loc->pai, reg) ? SIZE_ARQUIVOS : -1;
+
+  int entrada = dir_livres[--num_dir_livres];
+  dir[entrada] = *reg;
+  dir_marca(entrada);
+  indice_insere(entrada);
+  return entrada;
+}
+
+/* Diz se cabe mais uma entrada no diretorio do local; com trava_meta */
+static int cabe_entrada(Local *loc) {
+  if(loc->pai == 0 && num_dir_livres == 0)
+  {
+    printf("Erro: Diretorio cheio!\n");
+    return 0;
+  }
+  if(!livres_ao_menos(loc->pai != 0 ? ARVORE_RESERVA : 1))
+  {
+    printf("Erro: Nao ha espaco livre no disco!\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* Cria um arquivo (tipo 'T') ou um diretorio (tipo 'D') vazio no local; o
+ * chamador tem a trava_dir para escrita */
+static int cria(Local *loc, char tipo) {
+  dir_entry reg;
+  int entrada;
+
+    //Buscando arquivo no diretorio
+    if(busca_local(loc, &reg, &entrada))
+    {
+        printf("Erro: Ja existe um arquivo com esse nome!\n");
+        return 0;
+    }
+
+    //Buscando agrupamento livre na FAT; o de um diretorio guarda a raiz da
+    //arvore, inicialmente uma folha vazia
+    pthread_mutex_lock(&trava_meta);
+    if(!journal_folga(-1) || !cabe_entrada(loc))
+    {
+        pthread_mutex_unlock(&trava_meta);
+        return 0;
+    }
+    int posFat = tipo == 'D' ? no_novo(1) : aloca_agrup();
+
+    //Definindo valores
+    memset(&reg, 0, sizeof(dir_entry));
+    reg.used = tipo;
+    reg.first_block = posFat;
+    reg.size = 0;
+    entrada = posFat == -1 ? -1 : insere_local(loc, &reg);
+    if(entrada == -1)
+    {
+        if(posFat != -1 && tipo == 'T')
+          fat_set(posFat, AGRUP_LIVRE);
+        else if(posFat != -1)
+          no_libera(posFat);
+        pthread_mutex_unlock(&trava_meta);
+        printf("Erro: Falha atualizando o diretorio!\n");
+        return 0;
+    }
+    pthread_mutex_unlock(&trava_meta);
+
+    //Escrevendo no arquivo apenas os setores alterados
+    if(!conclui_operacao(-1))
+      return 0;
+
+    return 1;
+}
+
+int fs_create(char* file_name) {
+  struct timespec t;
+  Local loc;
+  op_inicia(&t);
+  pthread_rwlock_wrlock(&trava_dir);
+  int ok = resolve(file_name, &loc) && cria(&loc, 'T');
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_CREATE, &t);
+  return ok;
+}
+
+int fs_mkdir(char *dir_name) {
+  struct timespec t;
+  Local loc;
+  op_inicia(&t);
+  pthread_rwlock_wrlock(&trava_dir);
+  int ok = resolve(dir_name, &loc) && cria(&loc, 'D');
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_CREATE, &t);
+  return ok;
+}
+
+/* Remove o arquivo, ou o diretorio se estiver vazio; o chamador tem a
+ * trava_dir para escrita */
+static int remove_arquivo(Local *loc) {
+  dir_entry reg;
+  int i;
+  int aberto = 0;
+  int ok = 1;
+
+  if(!busca_local(loc, &reg, &i))
+  {
+    printf("Erro: Arquivo inexistente!\n");
+
+    return 0;
+  }
+
+  if(i != -1)
+  {
+    pthread_rwlock_rdlock(&arquivos[i].trava);
+    aberto = reg.used == 'T' && arquivos[i].abertos > 0;
+    pthread_rwlock_unlock(&arquivos[i].trava);
+  }
+  pthread_mutex_lock(&trava_meta);
+  if(i == -1)
+    aberto = espelho_busca(loc) != -1;
+  if(aberto)
+  {
+    pthread_mutex_unlock(&trava_meta);
+    printf("Erro: Arquivo %s esta aberto!\n", loc->nome);
+    return 0;
+  }
+  if(!journal_folga(-1) || (reg.used == 'T' && !refs_carrega()))
+  {
+    pthread_mutex_unlock(&trava_meta);
+    return 0;
+  }
+
+  if(reg.used == 'D')
+  {
+    no_arvore raiz;
+
+    if(!no_le(reg.first_block, &raiz))
+    {
+      pthread_mutex_unlock(&trava_meta);
+      return 0;
+    }
+    if(raiz.num > 0)
+    {
+      pthread_mutex_unlock(&trava_meta);
+      printf("Erro: Diretorio %s nao esta vazio!\n", loc->nome);
+      return 0;
+    }
+    if(!no_libera(reg.first_block))
+    {
+      pthread_mutex_unlock(&trava_meta);
+      return 0;
+    }
+  }
+
+  //A entrada sai antes, ja que a cadeia longa pode ser liberada em mais de
+  //uma transacao
+  if(i != -1)
+  {
+    indice_remove(i);
+    dir[i].used = 'F';
+    dir_marca(i);
+    dir_livres[num_dir_livres++] = i;
+  }
+  else
+  {
+    ok = arvore_remove(loc->pai, loc->nome);
+  }
+
+  if(ok && reg.used == 'T' && !solta_cadeia(reg.first_block, -1))
+  {
+    //Removendo o arquivo; agrupamentos compartilhados com clones continuam.
+    //Com erro na FAT a entrada sai mesmo assim, ficando alocado o resto da
+    //cadeia.
+    printf("Erro: Falha liberando os agrupamentos de %s!\n", loc->nome);
+    ok = 0;
+  }
+  pthread_mutex_unlock(&trava_meta);
+
+  //Escrevendo no arquivo apenas os setores alterados
+  if(!conclui_operacao(-1))
+    return 0;
+
+  return ok;
+}
+
+int fs_remove(char *file_name) {
+  struct timespec t;
+  Local loc;
+  op_inicia(&t);
+  pthread_rwlock_wrlock(&trava_dir);
+  int ok = resolve(file_name, &loc) && remove_arquivo(&loc);
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_REMOVE, &t);
+  return ok;
+}
+
+/* Cria destino compartilhando a cadeia de origem; o chamador tem a
+ * trava_dir para escrita */
+static int clona(Local *origem, Local *destino) {
+  dir_entry reg;
+  dir_entry novo;
+  int src;
+  int entrada;
+
+  if(!busca_local(origem, &reg, &src) || reg.used != 'T')
+  {
+    printf("Erro: Arquivo %s nao existe!\n", origem->nome);
+    return 0;
+  }
+  if(busca_local(destino, &novo, &entrada))
+  {
+    printf("Erro: Ja existe um arquivo com esse nome!\n");
+    return 0;
+  }
+  if(src == -1)
+  {
+    pthread_mutex_lock(&trava_meta);
+    src = espelho_busca(origem);
+    pthread_mutex_unlock(&trava_meta);
+  }
+
+  //O setor incompleto da origem precisa estar no disco para o clone ve-lo
+  if(src != -1)
+  {
+    pthread_rwlock_wrlock(&arquivos[src].trava);
+    if(arquivos[src].escrita && !grava_parcial(src))
+    {
+      pthread_rwlock_unlock(&arquivos[src].trava);
+      return 0;
+    }
+  }
+
+  pthread_mutex_lock(&trava_meta);
+  //O registro de quem esta aberto e o mais novo; um espelho pode ter sido
+  //fechado nesse meio tempo, levando o registro para a arvore
+  int pos = src;
+  if(src >= SIZE_DIR && (espelho_pai[src - SIZE_DIR] != origem->pai ||
+                         strcmp(dir[src].name, origem->nome)))
+  {
+    arvore_busca(origem->pai, origem->nome, &reg, 0);
+    pos = -1;
+  }
+  else if(src != -1)
+    reg = dir[src];
+
+  //A origem que ate aqui nao dividia nada passa a ser a dona da cadeia
+  int n = reg.size / tam_agrup + 1;
+  int exclusiva = -1;
+  if(journal_folga(src) && refs_carrega())
+    exclusiva = pos != -1 && arquivos[pos].abertos > 0 ? arquivos[pos].compartilhado >= n
+                                                       : cadeia_exclusiva(reg.first_block, n);
+  if(exclusiva == -1 || !cabe_entrada(destino))
+  {
+    pthread_mutex_unlock(&trava_meta);
+    if(src != -1)
+      pthread_rwlock_unlock(&arquivos[src].trava);
+    return 0;
+  }
+
+  entrada = -1;
+  if(ref_soma(reg.first_block, 1))
+  {
+    novo = reg;
+    novo.dono = 0;
+    entrada = insere_local(destino, &novo);
+    if(entrada == -1)
+      ref_soma(reg.first_block, -1);
+  }
+  if(entrada == -1)
+    printf("Erro: Falha atualizando o diretorio!\n");
+  else
+  {
+    if(pos != -1)
+      arquivos[pos].compartilhado = 0;
+    if(exclusiva && !reg.dono)
+    {
+      reg.dono = 1;
+      if(pos != -1)
+      {
+        dir[pos].dono = 1;
+        dir_marca(pos);
+      }
+      else
+        arvore_busca(origem->pai, origem->nome, &reg, 1);
+    }
+  }
+  pthread_mutex_unlock(&trava_meta);
+  if(src != -1)
+    pthread_rwlock_unlock(&arquivos[src].trava);
+
+  if(entrada == -1)
+    return 0;
+
+  if(!conclui_operacao(-1))
+    return 0;
+
+  return 1;
+}
+
+int fs_clone(char *origem, char *destino) {
+  struct timespec t;
+  Local de;
+  Local para;
+  op_inicia(&t);
+  pthread_rwlock_wrlock(&trava_dir);
+  int ok = resolve(origem, &de) && resolve(destino, &para) && clona(&de, &para);
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_CLONE, &t);
+  return ok;
+}
+
+/* Agrupamento da raiz do diretorio dir_name (0 na raiz do disco), ou 0
+ * com erro se ele nao existir; com trava_dir */
+static int resolve_dir(char *dir_name, int *pai) {
+  Local loc;
+  dir_entry reg;
+  int entrada;
+
+  *pai = 0;
+  if(dir_name[strspn(dir_name, "/")] == '\0')
+    return 1;
+  if(!resolve(dir_name, &loc) || !busca_local(&loc, &reg, &entrada) || reg.used != 'D')
+  {
+    printf("Erro: Diretorio %s nao existe!\n", dir_name);
+    return 0;
+  }
+  *pai = reg.first_block;
+  return 1;
+}
+
+/* Tamanho atual do arquivo do registro, guardado no espelho se o arquivo
+ * estiver aberto; com trava_meta */
+static int tamanho_atual(dir_entry *reg, int pai) {
+  Local loc;
+
+  if(pai == 0)
+    return reg->size;
+  loc.pai = pai;
+  copia_nome(loc.nome, reg->name);
+  int espelho = espelho_busca(&loc);
+  return espelho != -1 ? dir[espelho].size : reg->size;
+}
+
+int fs_opendir(fs_dir *d, char *dir_name) {
+  int pai;
+
+  if(strlen(dir_name) >= FS_CAMINHO_MAX)
+  {
+    printf("Erro: Caminho muito longo!\n");
+    return 0;
+  }
+  pthread_rwlock_rdlock(&trava_dir);
+  int ok = resolve_dir(dir_name, &pai);
+  pthread_rwlock_unlock(&trava_dir);
+  if(!ok)
+    return 0;
+
+  strcpy(d->caminho, dir_name);
+  d->pos = 0;
+  d->num = 0;
+  d->fim = 0;
+  d->prox_raiz = 0;
+  d->apos[0] = '\0';
+  return 1;
+}
+
+/* Lote de fs_readdir em montagem */
+typedef struct {
+  fs_dir *d;
+  int pai;
+} LoteDir;
+
+static int visita_lote(dir_entry *reg, void *ctx) {
+  LoteDir *l = ctx;
+  fs_dir *d = l->d;
+
+  if(d->num == FS_DIR_LOTE)
+    return 0;
+  fs_entrada *e = &d->lote[d->num++];
+  copia_nome(e->nome, reg->name);
+  e->tipo = reg->used;
+  e->tamanho = reg->used == 'T' ? tamanho_atual(reg, l->pai) : 0;
+  e->primeiro = reg->first_block;
+  copia_nome(d->apos, reg->name);
+  return 1;
+}
+
+/* Le o proximo lote do diretorio. O caminho e resolvido de novo a cada
+ * lote, ja que o diretorio pode ter sido removido entre eles. */
+static int le_lote(fs_dir *d) {
+  struct timespec t;
+  LoteDir l;
+  int ok;
+
+  op_inicia(&t);
+  d->pos = 0;
+  d->num = 0;
+  l.d = d;
+  pthread_rwlock_rdlock(&trava_dir);
+  ok = resolve_dir(d->caminho, &l.pai);
+  pthread_mutex_lock(&trava_meta);
+  if(ok && l.pai != 0)
+  {
+    int r = arvore_percorre(l.pai, d->apos, visita_lote, &l);
+    ok = r != -1;
+    d->fim = r == 1;
+  }
+  else if(ok)
+  {
+    while(d->prox_raiz < SIZE_DIR && d->num < FS_DIR_LOTE)
+    {
+      dir_entry *reg = &dir[d->prox_raiz++];
+      if(reg->used == 'T' || reg->used == 'D')
+        visita_lote(reg, &l);
+    }
+    d->fim = d->prox_raiz == SIZE_DIR;
+  }
+  pthread_mutex_unlock(&trava_meta);
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_LIST, &t);
+  return ok;
+}
+
+int fs_readdir(fs_dir *d, fs_entrada *e) {
+  if(d->pos == d->num)
+  {
+    if(d->fim)
+      return 0;
+    if(!le_lote(d))
+      return -1;
+    if(d->num == 0)
+      return 0;
+  }
+  *e = d->lote[d->pos++];
+  return 1;
+}
+
+void fs_closedir(fs_dir *d) {
+  d->pos = d->num = 0;
+  d->fim = 1;
+}
+
+/* Reserva um descritor livre, ou -1 */
+static int descritor_novo() {
+  int d = -1;
+
+  pthread_mutex_lock(&trava_meta);
+  if(num_descritores_livres > 0)
+  {
+    d = descritores_livres[--num_descritores_livres];
+  }
+  pthread_mutex_unlock(&trava_meta);
+  if(d == -1)
+    printf("Erro: Arquivos abertos demais!\n");
+  return d;
+}
+
+static void descritor_solta(int d) {
+  pthread_mutex_lock(&trava_meta);
+  descritores_livres[num_descritores_livres++] = d;
+  pthread_mutex_unlock(&trava_meta);
+}
+
+/* Entrada do arquivo do descritor, se ele estiver aberto no modo dado, ou
+ * -1; com a trava do descritor */
+static int descritor_arquivo(int file, char estado) {
+  Descritor *desc = &descritores[file];
+
+  if(desc->estado == estado)
+    return desc->arquivo;
+  if(desc->estado == ARQ_ABERTO_LEITURA)
+    printf("Erro: Arquivo aberto para leitura!\n");
+  else if(desc->estado == ARQ_ABERTO_ESCRITA)
+    printf("Erro: Arquivo aberto para escrita!\n");
+  else
+    printf("Erro: Arquivo nao foi aberto!\n");
+  return -1;
+}
+
+/* Abre um descritor no modo dado para o arquivo da entrada pos. O primeiro
+ * descritor monta o mapa de extensoes, que a escrita mantem dai em diante */
+static int abre_entrada(int pos, char *file_name, char estado) {
+  int d = descritor_novo();
+  Arquivo *arq = &arquivos[pos];
+  int ok = 1;
+
+  if(d == -1)
+    return -1;
+  Descritor *desc = &descritores[d];
+
+  pthread_rwlock_wrlock(&desc->trava);
+  pthread_rwlock_wrlock(&arq->trava);
+  if(estado == ARQ_ABERTO_ESCRITA && arq->escrita)
+  {
+    printf("Erro: Arquivo %s ja esta aberto para escrita!\n", file_name);
+    ok = 0;
+  }
+  else
+  {
+    pthread_mutex_lock(&trava_meta);
+    if(arq->abertos == 0 && (ok = monta_extensoes(pos)))
+      arq->parcialSujo = 0;
+    pthread_mutex_unlock(&trava_meta);
+  }
+  if(ok)
+  {
+    arq->abertos++;
+    if(estado == ARQ_ABERTO_ESCRITA)
+      arq->escrita = 1;
+    desc->estado = estado;
+    desc->arquivo = pos;
+    desc->posAtual = 0;
+    desc->extAtual = 0;
+    desc->proxSeq = 0;
+    desc->janela = 0;
+  }
+  pthread_rwlock_unlock(&arq->trava);
+  pthread_rwlock_unlock(&desc->trava);
+
+  if(!ok)
+    descritor_solta(d);
+  return ok ? d : -1;
+}
+
+/* Abre o arquivo; o chamador tem a trava_dir (para escrita no modo FS_W).
+ * Arquivos de subdiretorios sao abertos em um espelho, dividido por todos
+ * os descritores do arquivo. */
+static int abre(char *file_name, int mode) {
+  Local loc;
+  dir_entry reg;
+  int pos;
+
+	if(!resolve(file_name, &loc))
+		return -1;
+	//Buscando arquivo no diretorio
+	if(!busca_local(&loc, &reg, &pos))
+	{
+		if(mode == FS_R)
+		{
+			printf("Erro: Arquivo %s nao existe!\n", file_name);
+    	return -1;
+		}
+
+		//Escrita em arquivo novo
+		if(!cria(&loc, 'T') || !busca_local(&loc, &reg, &pos))
+			return -1;
+	}
+	if(reg.used != 'T')
+	{
+		printf("Erro: %s e um diretorio!\n", file_name);
+		return -1;
+	}
+
+	char estado = mode == FS_R ? ARQ_ABERTO_LEITURA : ARQ_ABERTO_ESCRITA;
+	if(pos != -1)
+		return abre_entrada(pos, file_name, estado);
+
+	pos = espelho_novo(&loc, file_name);
+	if(pos == -1)
+		return -1;
+	int d = abre_entrada(pos, file_name, estado);
+	if(d == -1)
+		espelho_solta(pos);
+  return d;
+}
+
+int fs_open(char *file_name, int mode) {
+  struct timespec t;
+  op_inicia(&t);
+  if(mode == FS_R)
+    pthread_rwlock_rdlock(&trava_dir);
+  else
+    pthread_rwlock_wrlock(&trava_dir);
+  int pos = abre(file_name, mode);
+  pthread_rwlock_unlock(&trava_dir);
+  op_conclui(FS_OP_OPEN, &t);
+  return pos;
+}
+
+/* Fecha o descritor; o chamador tem a trava dele para escrita */
+static int fecha(int file)  {
+	Descritor *desc = &descritores[file];
+
+	if(desc->estado!=ARQ_ABERTO_ESCRITA && desc->estado!=ARQ_ABERTO_LEITURA){
+		printf("Erro: Arquivo ja esta fechado!\n");
+    	return 0;
+	}
+
+	int pos = desc->arquivo;
+	Arquivo *arq = &arquivos[pos];
+	pthread_rwlock_wrlock(&arq->trava);
+	if(desc->estado == ARQ_ABERTO_ESCRITA)
+	{
+		if(!grava_parcial(pos))
+		{
+			pthread_rwlock_unlock(&arq->trava);
+			return 0;
+		}
+		arq->escrita = 0;
+	}
+	arq->abertos--;
+	pthread_rwlock_unlock(&arq->trava);
+
+	antecipa_libera(desc);
+	desc->estado = ARQ_FECHADO;
+	desc->posAtual = -1;
+	descritor_solta(file);
+	if(pos >= SIZE_DIR && !espelho_solta(pos))
+		return 0;
+  return 1;
+}
+
+int fs_close(int file)  {
+  struct timespec t;
+  if(!arquivo_valido(file))
+    return 0;
+  op_inicia(&t);
+  pthread_rwlock_wrlock(&descritores[file].trava);
+  int ok = fecha(file);
+  pthread_rwlock_unlock(&descritores[file].trava);
+  op_conclui(FS_OP_CLOSE, &t);
+  return ok;
+}
+
+/* Aloca os agrupamentos que faltam para o arquivo crescer size bytes */
+static int aloca_para_escrita(int file, int size) {
+  //Verificando se existe espaço no disco para escrita
+  //Calculando quantos agrupamentos faltam para o tamanho final (a cadeia
+  //sempre tem um agrupamento a mais que os completamente ocupados)
+  int tamFinal = (dir[file].size + size) / tam_agrup - dir[file].size / tam_agrup;
+
+  if(!livres_ao_menos(tamFinal))
+  {
+      printf("Erro: Nao ha espaco livre no disco!\n");
+      return 0;
+  }
+
+  //Ultimo agrupamento da cadeia, no fim do mapa de extensoes
+  Arquivo *arq = &arquivos[file];
+  Extensao *ult = &arq->ext[arq->numExt - 1];
+  int agrupAtual = ult->agrup + ult->tam - 1;
+
+  //O que vem depois dele ja nao e de nenhum arquivo: sobras de uma escrita
+  //interrompida ou o fim de um clone maior que foi removido
+  unsigned int prox;
+  if(tamFinal > 0 && (!fat_get(agrupAtual, &prox) ||
+     (prox != AGRUP_ULTIMO && (!fat_set(agrupAtual, AGRUP_ULTIMO) || !solta_cadeia(prox, file)))))
+    return 0;
+
+  //Enquanto houverem agrup. a serem escritos, aloca sequencias contiguas,
+  //de preferencia emendadas no fim do arquivo, ate ALOCA_LOTE por vez; o
+  //que ja foi emendado fica como sobra se a operacao nao terminar
+  while (tamFinal>0) {
+      int obtidos;
+      if(!journal_folga(file))
+        return 0;
+      int posFat = aloca_extensao(agrupAtual + 1, tamFinal < ALOCA_LOTE ? tamFinal : ALOCA_LOTE, &obtidos);
+
+      if(posFat == -1)
+        return 0;
+      if(!fat_set(agrupAtual, posFat))
+      {
+        libera_cadeia(posFat, file);
+        return 0;
+      }
+      if(!ext_adiciona(arq, posFat, obtidos))
+        return 0;
+      agrupAtual = posFat + obtidos - 1;
+      tamFinal -= obtidos;
+  }
+  return 1;
+}
+
+/* Agrupamento de ordem k na cadeia do mapa */
+static int agrup_da_ordem(Arquivo *arq, int k) {
+  Extensao *x = &arq->ext[ext_busca(arq, &arq->extAtual, k)];
+
+  return x->agrup + k - x->inicio;
+}
+
+/* Acrescenta ao mapa para o trecho [ini, fim) das ordens do mapa de */
+static int ext_trecho(Arquivo *para, Arquivo *de, int ini, int fim) {
+  for(int e = 0; e < de->numExt && ini < fim; e++)
+  {
+    Extensao *x = &de->ext[e];
+    if(x->inicio + x->tam <= ini)
+      continue;
+    int tam = (x->inicio + x->tam < fim ? x->inicio + x->tam : fim) - ini;
+    if(!ext_adiciona(para, x->agrup + ini - x->inicio, tam))
+      return 0;
+    ini += tam;
+  }
+  return 1;
+}
+
+/* Torna so do arquivo os agrupamentos da cadeia ate a ordem ate: os que
+ * outro arquivo tambem alcanca, do primeiro deles ate ate, sao copiados, e
+ * a copia entra no lugar deles. Se o arquivo continua depois de ate, a copia
+ * emenda no agrupamento seguinte da cadeia antiga, que passa a ter mais uma
+ * referencia. */
+static int separa(int file, int ate) {
+  Arquivo *arq = &arquivos[file];
+  int n = agrups_do_arquivo(file);
+  int de = arq->compartilhado;
+  Arquivo copia;
+  Arquivo mapa;
+
+  if(de > ate)
+    return 1;
+  int tam = ate - de + 1;
+  if(!grava_parcial(file))
+    return 0;
+
+  //Alocando a copia
+  memset(&copia, 0, sizeof(Arquivo));
+  memset(&mapa, 0, sizeof(Arquivo));
+  pthread_mutex_lock(&trava_meta);
+  if(!livres_ao_menos(tam + ARVORE_RESERVA))
+  {
+    pthread_mutex_unlock(&trava_meta);
+    printf("Erro: Nao ha espaco livre no disco!\n");
+    return 0;
+  }
+  //A copia fica anotada como orfa ate ser emendada, ja que ela pode ser
+  //confirmada antes disso
+  int orfao = orfao_livre();
+  int ultimo = -1;
+  for(int faltam = tam; faltam > 0; )
+  {
+    int obtidos;
+    int posFat = -1;
+    if(journal_folga(file))
+      posFat = aloca_extensao(ultimo + 1, faltam < ALOCA_LOTE ? faltam : ALOCA_LOTE, &obtidos);
+
+    //Em erro, a parte ja alocada da copia e devolvida: a sequencia nova e
+    //a cadeia anterior, que termina em ultimo
+    if(posFat == -1 || !ext_adiciona(&copia, posFat, obtidos) ||
+       (ultimo != -1 && !fat_set(ultimo, posFat)))
+    {
+      if(orfao != -1)
+        orfao_poe(orfao, 0);
+      if(posFat != -1)
+        libera_cadeia(posFat, file);
+      if(ultimo != -1)
+        libera_cadeia(copia.ext[0].agrup, file);
+      pthread_mutex_unlock(&trava_meta);
+      free(copia.ext);
+      return 0;
+    }
+    if(ultimo == -1 && orfao != -1)
+      orfao_poe(orfao, posFat);
+    ultimo = posFat + obtidos - 1;
+    faltam -= obtidos;
+  }
+  pthread_mutex_unlock(&trava_meta);
+
+  //Mapa novo: o comeco que ja era so do arquivo, a copia e o resto da
+  //cadeia antiga
+  int ok = ext_trecho(&mapa, arq, 0, de) && ext_trecho(&mapa, &copia, 0, tam) &&
+           ext_trecho(&mapa, arq, ate + 1, n);
+
+  //Copiando os dados, ate AGRUPS_REQ agrupamentos por vez; os agrupamentos
+  //antigos continuam referenciados ate o fim
+  char *buffer = malloc(AGRUPS_REQ * tam_agrup);
+  ok = ok && buffer != NULL;
+  for(int i = 0; ok && i < tam; )
+  {
+    Extensao *x = &arq->ext[ext_busca(arq, &arq->extAtual, de + i)];
+    Extensao *para = &copia.ext[ext_busca(&copia, &copia.extAtual, i)];
+    int m = tam - i;
+    if(m > x->inicio + x->tam - (de + i))
+      m = x->inicio + x->tam - (de + i);
+    if(m > para->inicio + para->tam - i)
+      m = para->inicio + para->tam - i;
+    if(m > AGRUPS_REQ)
+      m = AGRUPS_REQ;
+
+    //So os setores com dados do arquivo tem soma a conferir
+    int origem = (x->agrup + de + i - x->inicio) * setores_agrup;
+    int destino = (para->agrup + i - para->inicio) * setores_agrup;
+    int conferir = (dir[file].size + SECTORSIZE - 1) / SECTORSIZE - (de + i) * setores_agrup;
+    if(conferir > m * setores_agrup)
+      conferir = m * setores_agrup;
+    ok = bl_read_range(origem, m * setores_agrup, buffer) &&
+         (conferir <= 0 || somas_confere(origem, conferir, buffer, 1)) &&
+         somas_grava(destino, m * setores_agrup, buffer) &&
+         bl_write_range(destino, m * setores_agrup, buffer);
+    i += m;
+  }
+  free(buffer);
+
+  //Emendando a copia: primeiro no resto da cadeia antiga, depois no lugar
+  //do trecho copiado, na entrada ou no agrupamento anterior
+  pthread_mutex_lock(&trava_meta);
+  ok = ok && journal_folga(file);
+  unsigned int primeiro = copia.ext[0].agrup;
+  unsigned int velho = agrup_da_ordem(arq, de);
+  unsigned int prox = ate + 1 < n ? (unsigned int) agrup_da_ordem(arq, ate + 1) : AGRUP_ULTIMO;
+  int emendada = 0;
+  if(ok && prox != AGRUP_ULTIMO)
+  {
+    ok = ref_soma(prox, 1);
+    if(ok && !fat_set(ultimo, prox))
+    {
+      ref_soma(prox, -1);
+      ok = 0;
+    }
+    emendada = ok;
+  }
+  if(ok && de > 0)
+    ok = fat_set(agrup_da_ordem(arq, de - 1), primeiro);
+  if(orfao != -1)
+    orfao_poe(orfao, 0);
+  if(!ok)
+  {
+    //Sem desfazer a emenda a copia fica alocada, para nao soltar o resto
+    if(!emendada || (fat_set(ultimo, AGRUP_ULTIMO) && ref_soma(prox, -1)))
+      libera_cadeia(primeiro, file);
+    pthread_mutex_unlock(&trava_meta);
+    free(copia.ext);
+    free(mapa.ext);
+    printf("Erro: Falha copiando arquivo compartilhado!\n");
+    return 0;
+  }
+  if(de == 0)
+  {
+    dir[file].first_block = primeiro;
+    dir_marca(file);
+  }
+  //A copia ja e valida: com erro na FAT ao soltar a cadeia antiga o arquivo
+  //passa para ela mesmo assim e a escrita falha
+  ok = solta_cadeia(velho, file);
+  pthread_mutex_unlock(&trava_meta);
+
+  free(arq->ext);
+  free(copia.ext);
+  arq->ext = mapa.ext;
+  arq->numExt = mapa.numExt;
+  arq->capExt = mapa.capExt;
+  arq->extAtual = 0;
+  arq->compartilhado = ate + 1 < n ? ate + 1 : INT_MAX;
+  arq->versao++;
+  if(!ok)
+    printf("Erro: Falha liberando a cadeia compartilhada!\n");
+  return ok;
+}
+
+/* Garante que o arquivo pode crescer size bytes no lugar, copiando o que
+ * ele divide da cadeia se nao for o dono, e aloca os agrupamentos que
+ * faltam */
+static int prepara_escrita(int file, long long size) {
+  if(size > 0 && !pode_estender(file) && !separa(file, agrups_do_arquivo(file) - 1))
+    return 0;
+
+  pthread_mutex_lock(&trava_meta);
+  int ok = journal_folga(file) && aloca_para_escrita(file, size);
+  pthread_mutex_unlock(&trava_meta);
+  return ok;
+}
+
+/* Acrescenta size bytes ao fim do arquivo file; com a trava do arquivo para
+ * escrita */
+static int escreve(char *buffer, int size, int file) {
+  if(size < 0)
+  {
+    printf("Erro: Tamanho invalido!\n");
+    return -1;
+  }
+  if((long long) dir[file].size + size > INT_MAX)
+  {
+    printf("Erro: Arquivo muito grande!\n");
+    return -1;
+  }
+
+  if(!prepara_escrita(file, size))
+    return -1;
+
+  //Escrevendo (EFETIVAMENTE) dados no disco. O setor incompleto do fim do
+  //arquivo fica no buffer do arquivo e so e gravado quando completa, ou
+  //no fechamento e no fs_sync.
+  Arquivo *arq = &arquivos[file];
+  int pos = dir[file].size;
+  int escrito = 0;
+
+  //Completando o setor incompleto
+  if(pos % SECTORSIZE != 0 && size > 0)
+  {
+    int byteSetor = pos % SECTORSIZE;
+    int setor = agrup_do_byte(file, &arq->extAtual, pos)*setores_agrup + (pos % tam_agrup) / SECTORSIZE;
+
+    if(!arq->parcialSujo && !le_setor(setor, arq->parcial))
+    {
+      printf("Erro: Falha lendo dados do disco!\n");
+      return -1;
+    }
+    escrito = SECTORSIZE - byteSetor;
+    if(escrito > size)
+      escrito = size;
+    memcpy(arq->parcial + byteSetor, buffer, escrito);
+    arq->setorParcial = setor;
+    arq->parcialSujo = 1;
+    pos += escrito;
+
+    if(pos % SECTORSIZE == 0 && !grava_parcial(file))
+      return -1;
+  }
+
+  //Setores inteiros, direto do buffer do usuario
+  int inteiros = (size - escrito) / SECTORSIZE * SECTORSIZE;
+  if(inteiros > 0)
+  {
+    if(!transfere(file, &arq->extAtual, pos, buffer + escrito, inteiros, 1))
+    {
+        printf("Erro: Falha escrevendo dados no disco!\n");
+        return -1;
+    }
+    escrito += inteiros;
+    pos += inteiros;
+  }
+
+  //Inicio de um novo setor incompleto
+  if(escrito < size)
+  {
+    memcpy(arq->parcial, buffer + escrito, size - escrito);
+    arq->setorParcial = agrup_do_byte(file, &arq->extAtual, pos)*setores_agrup + (pos % tam_agrup) / SECTORSIZE;
+    arq->parcialSujo = 1;
+  }
+
+  //Atualizando tamanho do arquivo no diretório
+  pthread_mutex_lock(&trava_meta);
+  if(!journal_folga(file))
+  {
+    pthread_mutex_unlock(&trava_meta);
+    return -1;
+  }
+  dir[file].size+=size;
+  dir_marca(file);
+  pthread_mutex_unlock(&trava_meta);
+
+  //Salvando no disco apenas os setores alterados das estruturas
+  if(!conclui_operacao(file))
+    return -1;
+
+  return size;
+}
+
+/* Escreve size bytes no arquivo file a partir do byte pos, que vai ate o
+ * fim do arquivo. O trecho que ja existe e regravado no lugar, depois de os
+ * agrupamentos ate ele deixarem de ser compartilhados com clones; o restante
+ * e acrescentado ao fim. Com a trava do arquivo para escrita. */
+static int escreve_em(char *buffer, int size, int file, int pos) {
+  Arquivo *arq = &arquivos[file];
+  int dentro = dir[file].size - pos;
+
+  if(pos < 0 || dentro < 0)
+  {
+      printf("Erro: Posicao fora do arquivo!\n");
+      return -1;
+  }
+  if(size < 0)
+  {
+    printf("Erro: Tamanho invalido!\n");
+    return -1;
+  }
+  if((long long) pos + size > INT_MAX)
+  {
+    printf("Erro: Arquivo muito grande!\n");
+    return -1;
+  }
+  if(dentro > size)
+    dentro = size;
 
-  if(arquivos[file].estado==ARQ_ABERTO_ESCRITA)
+  if(dentro > 0)
   {
-      printf("Erro: Arquivo aberto para escrita!\n");
+    //O setor incompleto pendente vai antes para o disco, ja que a regravacao
+    //le e grava as pontas la
+    if(!grava_parcial(file))
+      return -1;
+
+    int ate = (pos + dentro - 1) / tam_agrup;
+    if(arq->compartilhado <= ate && (!separa(file, ate) || !conclui_operacao(file)))
       return -1;
+
+    arq->versao++;
+    if(!transfere(file, &arq->extAtual, pos, buffer, dentro, 1))
+    {
+        printf("Erro: Falha escrevendo dados no disco!\n");
+        return -1;
+    }
+  }
+
+  if(dentro < size && escreve(buffer + dentro, size - dentro, file) == -1)
+    return -1;
+  return size;
+}
+
+int fs_write(char *buffer, int size, int file) {
+  struct timespec t;
+  if(!arquivo_valido(file))
+    return -1;
+  op_inicia(&t);
+  int escrito = -1;
+  pthread_rwlock_rdlock(&descritores[file].trava);
+  int pos = descritor_arquivo(file, ARQ_ABERTO_ESCRITA);
+  if(pos != -1)
+  {
+    pthread_rwlock_wrlock(&arquivos[pos].trava);
+    escrito = escreve(buffer, size, pos);
+    pthread_rwlock_unlock(&arquivos[pos].trava);
+  }
+  pthread_rwlock_unlock(&descritores[file].trava);
+  op_conclui(FS_OP_WRITE, &t);
+  return escrito;
+}
+
+int fs_pwrite(char *buffer, int size, int file, int pos) {
+  struct timespec t;
+  if(!arquivo_valido(file))
+    return -1;
+  op_inicia(&t);
+  int escrito = -1;
+  pthread_rwlock_rdlock(&descritores[file].trava);
+  int entrada = descritor_arquivo(file, ARQ_ABERTO_ESCRITA);
+  if(entrada != -1)
+  {
+    pthread_rwlock_wrlock(&arquivos[entrada].trava);
+    escrito = escreve_em(buffer, size, entrada, pos);
+    pthread_rwlock_unlock(&arquivos[entrada].trava);
   }
-  else if(arquivos[file].estado==ARQ_FECHADO){
-      printf("Erro: Arquivo nao foi aberto!\n");
+  pthread_rwlock_unlock(&descritores[file].trava);
+  op_conclui(FS_OP_WRITE, &t);
+  return escrito;
+}
+
+/* Le ate size bytes do arquivo file a partir do byte pos, com o cursor dado
+ * no mapa de extensoes; com a trava do arquivo (para leitura basta). Com o
+ * descritor desc, a leitura passa pela leitura antecipada dele. */
+static int le(char *buffer, int size, int file, int *cursor, int pos, Descritor *desc) {
+  Arquivo *arq = &arquivos[file];
+  int tamanho;
+
+  if(pos < 0 || pos > dir[file].size)
+  {
+      printf("Erro: Posicao fora do arquivo!\n");
       return -1;
   }
 
-  if(size < dir[file].size-arquivos[file].posAtual)
+  if(size < dir[file].size-pos)
   {
     tamanho = size;
   }
   else
   {
-    tamanho = dir[file].size-arquivos[file].posAtual;
+    tamanho = dir[file].size-pos;
+  }
+
+  if(tamanho <= 0)
+    return 0;
+
+  //O setor incompleto do fim do arquivo pode estar so no buffer da escrita,
+  //e entao nao e lido do disco
+  int doDisco = tamanho;
+  int inicio = dir[file].size / SECTORSIZE * SECTORSIZE;
+  if(arq->parcialSujo && pos + doDisco > inicio)
+    doDisco = pos < inicio ? inicio - pos : 0;
+
+  //Leitura, uma operacao por extensao, continuando da extensao em que a
+  //leitura anterior parou
+  int ok = 1;
+  if(doDisco > 0)
+    ok = desc != NULL ? le_antecipando(desc, file, pos, buffer, doDisco)
+                      : transfere(file, cursor, pos, buffer, doDisco, 0);
+  if(!ok)
+  {
+    printf("Erro: Falha lendo dados do disco!\n");
+    return -1;
+  }
+  if(desc != NULL)
+    desc->proxSeq = pos + tamanho;
+
+  if(doDisco < tamanho)
+  {
+    int de = pos > inicio ? pos : inicio;
+    memcpy(buffer + de - pos, arq->parcial + de - inicio, pos + tamanho - de);
+  }
+
+  return tamanho;
+}
+
+int fs_read(char *buffer, int size, int file) {
+  struct timespec t;
+  if(!arquivo_valido(file))
+    return -1;
+  op_inicia(&t);
+  int lido = -1;
+  Descritor *desc = &descritores[file];
+  pthread_rwlock_wrlock(&desc->trava);
+  int pos = descritor_arquivo(file, ARQ_ABERTO_LEITURA);
+  if(pos != -1)
+  {
+    pthread_rwlock_rdlock(&arquivos[pos].trava);
+    lido = le(buffer, size, pos, &desc->extAtual, desc->posAtual, desc);
+    pthread_rwlock_unlock(&arquivos[pos].trava);
+    if(lido > 0)
+      desc->posAtual += lido;
   }
+  pthread_rwlock_unlock(&desc->trava);
+  op_conclui(FS_OP_READ, &t);
+  return lido;
+}
+
+/* Le sem mexer na posicao do descritor: descritores e leituras do mesmo
+ * arquivo so dividem travas de leitura */
+int fs_pread(char *buffer, int size, int file, int pos) {
+  struct timespec t;
+  if(!arquivo_valido(file))
+    return -1;
+  op_inicia(&t);
+  int lido = -1;
+  Descritor *desc = &descritores[file];
+  pthread_rwlock_rdlock(&desc->trava);
+  int entrada = descritor_arquivo(file, ARQ_ABERTO_LEITURA);
+  if(entrada != -1)
+  {
+    int cursor = desc->extAtual;
+    pthread_rwlock_rdlock(&arquivos[entrada].trava);
+    lido = le(buffer, size, entrada, &cursor, pos, NULL);
+    pthread_rwlock_unlock(&arquivos[entrada].trava);
+  }
+  pthread_rwlock_unlock(&desc->trava);
+  op_conclui(FS_OP_READ, &t);
+  return lido;
+}
 
-  //Primeiro agrupamento a ser lido
-  for(int i = arquivos[file].posAtual/CLUSTERSIZE; i > 0 ; i--)
+static int posiciona(int file, int pos) {
+  Descritor *desc = &descritores[file];
+  int entrada = descritor_arquivo(file, ARQ_ABERTO_LEITURA);
+
+  if(entrada == -1)
+    return -1;
+
+  pthread_rwlock_rdlock(&arquivos[entrada].trava);
+  int ok = pos >= 0 && pos <= dir[entrada].size;
+  //Perto do cursor, a extensao e achada a partir dele; longe, por busca
+  //binaria no mapa
+  if(ok)
+    agrup_do_byte(entrada, &desc->extAtual, pos);
+  pthread_rwlock_unlock(&arquivos[entrada].trava);
+  if(!ok)
   {
-    agrup = fat[agrup];
+      printf("Erro: Posicao fora do arquivo!\n");
+      return -1;
   }
 
-  //Leitura
-  int lido = 0;
-  int byteSetor = arquivos[file].posAtual % SECTORSIZE;
-  int setor = (arquivos[file].posAtual / SECTORSIZE) % 8;
+  desc->posAtual = pos;
+  return pos;
+}
 
-  //Primeiro setor a ser lido
-  bl_read(agrup*8 + setor, bufferLeitura);
+int fs_seek(int file, int pos) {
+  struct timespec t;
+  if(!arquivo_valido(file))
+    return -1;
+  op_inicia(&t);
+  pthread_rwlock_wrlock(&descritores[file].trava);
+  int novaPos = posiciona(file, pos);
+  pthread_rwlock_unlock(&descritores[file].trava);
+  op_conclui(FS_OP_SEEK, &t);
+  return novaPos;
+}
 
-  do {
-    //Enquanto houver o que ler e espaço no buffer
-    while(lido < tamanho && byteSetor < SECTORSIZE && arquivos[file].posAtual < dir[file].size){
-        buffer[lido]=bufferLeitura[byteSetor];
-        lido++;
-        byteSetor++;
-        arquivos[file].posAtual++;
+/* Le (ou grava) n bytes do arquivo real fd a partir do byte pos */
+static int copia_real(int fd, long long pos, char *buffer, int n, int escrita) {
+  while(n > 0)
+  {
+    ssize_t r = escrita ? pwrite(fd, buffer, n, pos) : pread(fd, buffer, n, pos);
+    if(r == -1 && errno == EINTR)
+      continue;
+    if(r <= 0)
+    {
+      printf("Erro: Falha copiando o arquivo real!\n");
+      return 0;
     }
+    buffer += r;
+    pos += r;
+    n -= r;
+  }
+  return 1;
+}
 
-    //Indexando proximo setor
-    setor++;
-    setor=setor%8;
-    //Se acabou o agrupamento
-    if(setor==0){
-        agrup=fat[agrup];
+/* Com as somas, a copia de um trecho contiguo da imagem passa pela memoria,
+ * para os dados importados serem somados e os exportados, conferidos. Os
+ * pedacos acabam em fim de setor; na importacao, que acrescenta ao fim do
+ * arquivo, o ultimo setor e completado com zeros e gravado inteiro. */
+#define COPIA_SOMAS (1024 * 1024)
+
+static int copia_somada(int fd, long long real, long disco, long long n, int importa) {
+  char *buffer = malloc(COPIA_SOMAS + SECTORSIZE);
+  int ok = buffer != NULL;
+  Lote lote;
+
+  lote.num = 0;
+  lote.escrita = importa;
+  while(ok && n > 0)
+  {
+    int m = COPIA_SOMAS - disco % SECTORSIZE;
+    if(m > n)
+      m = n;
+    int resto = (disco + m) % SECTORSIZE ? SECTORSIZE - (disco + m) % SECTORSIZE : 0;
+
+    if(importa)
+    {
+      memset(buffer + m, 0, resto);
+      ok = copia_real(fd, real, buffer, m, 0) && transfere_continuo(disco, buffer, m + resto, &lote) &&
+           lote_conclui(&lote);
     }
-    byteSetor=0;
+    else
+      ok = transfere_continuo(disco, buffer, m, &lote) && lote_conclui(&lote) &&
+           copia_real(fd, real, buffer, m, 1);
+    real += m;
+    disco += m;
+    n -= m;
+  }
+  //Requisicoes que ficaram em voo depois de uma falha
+  ok = lote_conclui(&lote) && ok;
+  free(buffer);
+  return ok;
+}
 
-    //Lendo setor
-    bl_read(agrup*8 + setor, bufferLeitura);
+/* Copia n bytes entre o arquivo real fd (a partir do inicio) e o arquivo
+ * file (a partir do byte pos), com uma copia por extensao */
+static int copia_extensoes(int file, int pos, int fd, long long n, int importa) {
+  Arquivo *arq = &arquivos[file];
+  long long real = 0;
+  int cursor = 0;
 
-    }while(lido < tamanho && arquivos[file].posAtual < dir[file].size);//Enquanto houver dados no Buffer
+  while(n > 0)
+  {
+    Extensao *x = &arq->ext[ext_busca(arq, &cursor, pos / tam_agrup)];
+    long fimExt = (long) (x->inicio + x->tam) * tam_agrup;
+    long disco = (long) x->agrup * tam_agrup + pos - (long) x->inicio * tam_agrup;
+    long long m = n;
+    if(m > fimExt - pos)
+      m = fimExt - pos;
 
-  return lido;
+    int ok;
+    if(super.agrups_somas > 0)
+      ok = copia_somada(fd, real, disco, m, importa);
+    else
+      ok = importa ? bl_import(fd, real, disco, m) : bl_export(disco, m, fd, real);
+    if(!ok)
+      return 0;
+    real += m;
+    pos += m;
+    n -= m;
+  }
+  return 1;
+}
+
+/* Acrescenta n bytes do arquivo real ao arquivo file: os agrupamentos sao
+ * alocados de uma vez e os dados vao direto para eles */
+static int importa(int fd, long long n, int file) {
+  if(dir[file].size + n > INT_MAX)
+  {
+    printf("Erro: Arquivo muito grande!\n");
+    return 0;
+  }
+
+  if(!prepara_escrita(file, n))
+    return 0;
+
+  if(!copia_extensoes(file, dir[file].size, fd, n, 1))
+  {
+    printf("Erro: Falha escrevendo dados no disco!\n");
+    return 0;
+  }
+
+  pthread_mutex_lock(&trava_meta);
+  int ok = journal_folga(file);
+  if(ok)
+  {
+    dir[file].size += n;
+    dir_marca(file);
+  }
+  pthread_mutex_unlock(&trava_meta);
+  return ok;
+}
+
+int fs_import(int fd, char *file_name) {
+  struct timespec t;
+  op_inicia(&t);
+  struct stat sb;
+
+  if(fstat(fd, &sb) == -1)
+  {
+    printf("Erro: Arquivo real invalido!\n");
+    op_conclui(FS_OP_IMPORT, &t);
+    return 0;
+  }
+
+  int file = fs_open(file_name, FS_W);
+  if(file == -1)
+  {
+    op_conclui(FS_OP_IMPORT, &t);
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&descritores[file].trava);
+  int pos = descritores[file].arquivo;
+  pthread_rwlock_wrlock(&arquivos[pos].trava);
+  int ok = importa(fd, sb.st_size, pos);
+  pthread_rwlock_unlock(&arquivos[pos].trava);
+  ok = fecha(file) && ok;
+  pthread_rwlock_unlock(&descritores[file].trava);
+
+  //Metadados confirmados uma unica vez, depois de todos os dados
+  ok = confirma(-1, 0) && sincroniza() && ok;
+  op_conclui(FS_OP_IMPORT, &t);
+  return ok;
+}
+
+int fs_export(char *file_name, int fd) {
+  struct timespec t;
+  op_inicia(&t);
+
+  int file = fs_open(file_name, FS_R);
+  if(file == -1)
+  {
+    op_conclui(FS_OP_EXPORT, &t);
+    return 0;
+  }
+
+  //Com a trava do arquivo para escrita, para levar antes ao disco o setor
+  //incompleto de quem estiver escrevendo nele
+  pthread_rwlock_wrlock(&descritores[file].trava);
+  int pos = descritores[file].arquivo;
+  pthread_rwlock_wrlock(&arquivos[pos].trava);
+  int ok = grava_parcial(pos) && copia_extensoes(pos, 0, fd, dir[pos].size, 0);
+  if(!ok)
+    printf("Erro: Falha lendo dados do disco!\n");
+  pthread_rwlock_unlock(&arquivos[pos].trava);
+  ok = fecha(file) && ok;
+  pthread_rwlock_unlock(&descritores[file].trava);
+
+  op_conclui(FS_OP_EXPORT, &t);
+  return ok;
+}
+
+void fs_stats(fs_estatisticas *e) {
+  bl_estatisticas disco;
+
+  memcpy(e, &estat, sizeof(fs_estatisticas));
+  bl_stats(&disco);
+  e->setores_lidos = disco.setores_lidos;
+  e->setores_escritos = disco.setores_escritos;
+  e->syncs = disco.syncs;
+  e->cache_acertos = disco.cache_acertos;
+  e->cache_faltas = disco.cache_faltas;
+  e->reqs_assincronas = disco.reqs_assincronas;
+  e->setores_descartados = disco.setores_descartados;
+}
+
+void fs_stats_reset() {
+  memset(&estat, 0, sizeof(fs_estatisticas));
+  bl_stats_reset();
 }
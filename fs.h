@@ -23,13 +23,139 @@
 #define FS_R 0
 #define FS_W 1
 
+/* Operacoes medidas por fs_stats */
+#define FS_OP_INIT 0
+#define FS_OP_FORMAT 1
+#define FS_OP_LIST 2
+#define FS_OP_CREATE 3
+#define FS_OP_REMOVE 4
+#define FS_OP_OPEN 5
+#define FS_OP_CLOSE 6
+#define FS_OP_WRITE 7
+#define FS_OP_READ 8
+#define FS_OP_SEEK 9
+#define FS_OP_SYNC 10
+#define FS_OP_IMPORT 11
+#define FS_OP_EXPORT 12
+#define FS_OP_CLONE 13
+#define FS_NUM_OPS 14
+
+/* Faixas dos histogramas de latencia: a faixa 0 conta as operacoes com menos
+ * de 1 us, a faixa i as com [2^(i-1), 2^i) us; a ultima conta o restante. */
+#define FS_HIST_FAIXAS 24
+
+typedef struct {
+  /* Disco */
+  long setores_lidos;
+  long setores_escritos;
+  long syncs;
+  long cache_acertos;
+  long cache_faltas;
+  long reqs_assincronas;
+  long setores_descartados;
+  /* Sistema de arquivos */
+  long fat_varridas;          /* Entradas da FAT examinadas na alocacao */
+  long fat_paginas_lidas;     /* Paginas da FAT lidas do disco */
+  long saltos_cadeia;         /* Passos em cadeias e mapas de extensoes */
+  long sondagens_dir;         /* Entradas do indice do diretorio examinadas */
+  long bytes_antecipados;     /* Bytes pedidos pela leitura antecipada */
+  long antecipa_acertos;      /* Leituras atendidas por janelas ja lidas */
+  long somas_conferidas;      /* Setores de dados com a soma conferida */
+  long somas_erradas;         /* Setores cuja soma nao confere */
+  long ops[FS_NUM_OPS];
+  long long tempo_ns[FS_NUM_OPS];   /* Tempo total de cada operacao */
+  long hist[FS_NUM_OPS][FS_HIST_FAIXAS];
+} fs_estatisticas;
+
+/* Tamanho do agrupamento usado por fs_format; fs_format_cluster aceita
+ * potencias de 2 de 512 a 65536 bytes, gravadas no superbloco */
+#define FS_AGRUP_PADRAO 4096
+
+/* A FAT fica no disco e e lida em paginas de 4 KB conforme o uso;
+ * fs_fat_config limita quantas paginas ficam em RAM. Paginas alteradas so
+ * saem da memoria depois de confirmadas. */
+#define FS_FAT_PAGINAS_PADRAO 64
+
+/* A formatacao grava so o inicio da FAT: o resto vira um buraco na imagem
+ * esparsa, lido como agrupamentos livres. Com fs_descarte_config(1), os
+ * agrupamentos liberados tambem viram buracos, depois de a liberacao ser
+ * confirmada. */
+
+/* Com fs_somas_config(1), as formatacoes seguintes reservam uma tabela com o
+ * CRC32C de cada setor dos arquivos: a soma e gravada junto com os dados e
+ * conferida na leitura, que falha se o setor mudou no disco. */
+
+/* Os nomes aceitos por fs_create, fs_remove, fs_clone, fs_open, fs_import e
+ * fs_export podem ser caminhos "dir/sub/arquivo" a partir da raiz, com ate 24
+ * caracteres por nome. fs_list escreve a listagem da raiz no buffer de size
+ * bytes e falha se ela nao couber. Os demais diretorios sao listados com
+ * fs_opendir e fs_readdir.
+ *
+ * fs_open devolve um descritor; um arquivo pode ter varios abertos ao mesmo
+ * tempo, um so deles para escrita. fs_read e fs_seek usam a posicao do
+ * descritor e fs_write acrescenta ao fim do arquivo. fs_pread e fs_pwrite
+ * recebem a posicao e nao mexem na do descritor; fs_pwrite regrava o que ja
+ * existe a partir de pos (no maximo o tamanho do arquivo) e acrescenta o
+ * restante. */
+/* Entrada de diretorio devolvida por fs_readdir */
+typedef struct {
+  char nome[25];
+  char tipo;                  /* 'T' arquivo, 'D' diretorio */
+  int tamanho;                /* Bytes do arquivo */
+  unsigned int primeiro;      /* Primeiro agrupamento */
+} fs_entrada;
+
+#define FS_DIR_LOTE 32
+#define FS_CAMINHO_MAX 256
+
+/* Iterador de diretorio, de quem chama fs_opendir. As entradas sao lidas em
+ * lotes de FS_DIR_LOTE, cada um retomado depois da ultima entrada lida:
+ * entradas criadas ou removidas durante a listagem podem aparecer ou nao,
+ * mas as demais aparecem uma vez. Os subdiretorios saem em ordem de nome e
+ * a raiz na ordem da tabela. */
+typedef struct {
+  char caminho[FS_CAMINHO_MAX];
+  int pos;                    /* Proxima entrada do lote */
+  int num;                    /* Entradas no lote */
+  int fim;                    /* Se o lote terminou o diretorio */
+  int prox_raiz;              /* Raiz: proxima entrada da tabela */
+  char apos[25];              /* Subdiretorios: ultimo nome lido */
+  fs_entrada lote[FS_DIR_LOTE];
+} fs_dir;
+
+/* Resultados de fs_init, alem de 0 em falha de leitura. Sem disco montado
+ * (FS_NAO_FORMATADO ou FS_CORROMPIDO) o sistema fica vazio, so podendo ser
+ * formatado. */
+#define FS_MONTADO 1
+#define FS_NAO_FORMATADO 2
+#define FS_CORROMPIDO 3
+
 int fs_init();
 int fs_format();
-int fs_free();
+int fs_format_cluster(int tam_agrup);
+long long fs_free();
 int fs_list(char *buffer, int size);
+/* fs_readdir retorna 1 com a proxima entrada, 0 no fim e -1 em erro */
+int fs_opendir(fs_dir *d, char *dir_name);
+int fs_readdir(fs_dir *d, fs_entrada *e);
+void fs_closedir(fs_dir *d);
 int fs_create(char *file_name);
+int fs_mkdir(char *dir_name);
 int fs_remove(char *file_name);
+int fs_clone(char *origem, char *destino);
 int fs_open(char *file_name, int mode);
 int fs_close(int file);
 int fs_write(char *buffer, int size, int file);
 int fs_read(char *buffer, int size, int file);
+int fs_seek(int file, int pos);
+int fs_pread(char *buffer, int size, int file, int pos);
+int fs_pwrite(char *buffer, int size, int file, int pos);
+int fs_sync();
+int fs_import(int fd, char *file_name);
+int fs_export(char *file_name, int fd);
+void fs_journal_config(int atraso_ms);
+void fs_fat_config(int paginas);
+void fs_descarte_config(int ativo);
+void fs_somas_config(int ativo);
+void fs_stats(fs_estatisticas *e);
+void fs_stats_reset();
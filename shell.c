@@ -20,52 +20,79 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
 
 #define MAX_STR 256
 #define MAX_ARG 32
-#define COPY_BUFFER_SIZE 10
 
-void format();
+void format(int tam_agrup);
 void list();
+void listdir(char *dir);
 void create(char *file);
+void makedir(char *dir);
 void fremove(char *file);
 void copy(char *file1, char *file2);
 void copyf(char *file1, char *file2);
 void copyt(char *file1, char *file2);
+void stats();
 
 int main(int argc, char **argv) {
   char *image;
   int size;
+  int backend;
+  int descarte;
+  int somas;
   char linha[MAX_STR];
   char *args[MAX_ARG + 1];
   char *token;
   int i, tam;
 
   size = -1;
+  backend = BL_PREAD;
+  descarte = 0;
+  somas = 0;
+  while (argc >= 2 && (!strcmp(argv[1], "-m") || !strcmp(argv[1], "-d") ||
+                       !strcmp(argv[1], "-c"))) {
+    if (!strcmp(argv[1], "-m")) {
+      backend = BL_MMAP;
+    } else if (!strcmp(argv[1], "-d")) {
+      descarte = 1;
+    } else {
+      somas = 1;
+    }
+    argv++;
+    argc--;
+  }
   if (argc >= 2 && argc <= 3) {
     image = argv[1];
     if (argc > 2) {
       size = atoi(argv[2]) * 2048; /* Cada MB tem 2048 setores. */
     }
   } else {
-    printf("Uso: %s imagem [tamanho]\n", argv[0]);
-    printf("Onde: imagem é o arquivo contendo a imagem do disco.\n");
+    printf("Uso: %s [-m] [-d] [-c] imagem [tamanho]\n", argv[0]);
+    printf("Onde: -m (opcional) mapeia a imagem em memória.\n");
+    printf("      -d (opcional) devolve à imagem o espaço dos agrupamentos liberados.\n");
+    printf("      -c (opcional) formata com somas de verificação (CRC32C) dos dados.\n");
+    printf("      imagem é o arquivo contendo a imagem do disco.\n");
     printf("      tamanho (opcional) é o tamanho da imagem em MB.\n");
     exit(0);
   }
 
-  if (!bl_init(image, size)) {
+  if (!bl_init_backend(image, size, backend)) {
     exit(0);
   }
   printf("Arquivo de imagem %s aberto.\n", image);
-  printf("Tamanho %d setores (%d bytes).\n", bl_size(), bl_size() * SECTORSIZE);
+  printf("Tamanho %d setores (%lld bytes).\n", bl_size(), (long long) bl_size() * SECTORSIZE);
   
+  fs_descarte_config(descarte);
+  fs_somas_config(somas);
   if (!fs_init()) {
     exit(0);
   }
@@ -93,17 +120,36 @@ int main(int argc, char **argv) {
     }
 
     if (!strcmp(args[0], "exit")) {
+      fs_sync();
       exit(EXIT_SUCCESS);
     } else if (!strcmp(args[0], "format")) {
-      format();
+      if (i == 1) {
+	format(FS_AGRUP_PADRAO);
+      } else if (i == 2) {
+	format(atoi(args[1]));
+      } else {
+	printf("Uso: format [tamanho_agrupamento]\n");
+      }
     } else if (!strcmp(args[0], "list")) {
-      list();
+      if (i == 1) {
+	list();
+      } else if (i == 2) {
+	listdir(args[1]);
+      } else {
+	printf("Uso: list [dir]\n");
+      }
     } else if (!strcmp(args[0], "create")) {
       if (i == 2) {
 	create(args[1]);
       } else {
 	printf("Uso: create <file>\n");
       }
+    } else if (!strcmp(args[0], "mkdir")) {
+      if (i == 2) {
+	makedir(args[1]);
+      } else {
+	printf("Uso: mkdir <dir>\n");
+      }
     } else if (!strcmp(args[0], "remove")) {
       if (i == 2) {
 	fremove(args[1]);
@@ -128,23 +174,49 @@ int main(int argc, char **argv) {
       } else {
 	printf("Uso: copyt <file> <real_file>\n");
       }
+    } else if (!strcmp(args[0], "stats")) {
+      if (i == 1) {
+	stats();
+      } else if (i == 2 && !strcmp(args[1], "reset")) {
+	fs_stats_reset();
+      } else {
+	printf("Uso: stats [reset]\n");
+      }
     } else {
       printf("Comando inválido\n");
     }
   }
 }
 
-void format() {
-  if (fs_format()) {
-    printf("Formatação concluída. %d bytes livres.\n", fs_free());
+void format(int tam_agrup) {
+  if (fs_format_cluster(tam_agrup)) {
+    printf("Formatação concluída. %lld bytes livres.\n", fs_free());
   }
 }
 
 void list() {
-  char buffer[4096];
-  if (fs_list(buffer, 4096)) {
-    printf("%s", buffer);
-    printf("%d bytes livres.\n", fs_free());
+  listdir("/");
+}
+
+/* Lista o diretorio com o iterador, um lote de entradas por vez */
+void listdir(char *dir) {
+  fs_dir d;
+  fs_entrada e;
+  int r;
+
+  if (!fs_opendir(&d, dir)) {
+    return;
+  }
+  while ((r = fs_readdir(&d, &e)) == 1) {
+    if (e.tipo == 'D') {
+      printf("%s/\n", e.nome);
+    } else {
+      printf("%s\t\t%d\n", e.nome, e.tamanho);
+    }
+  }
+  fs_closedir(&d);
+  if (r == 0) {
+    printf("%lld bytes livres.\n", fs_free());
   }
 }
 
@@ -152,90 +224,76 @@ void create(char *file) {
   fs_create(file);
 }
 
+void makedir(char *dir) {
+  fs_mkdir(dir);
+}
+
 void fremove(char *file) {
   fs_remove(file);
 }
 
 void copy(char *file1, char *file2) {
-  int fd1, fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  int read;
-
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
-    return;
-  }
-
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fs_close(fd1);
-    return;
-  }
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      fs_close(fd1);
-      fs_close(fd2);
-      return;
-    }
-  }
-
-  fs_close(fd1);
-  fs_close(fd2);
+  fs_clone(file1, file2);
 }
 
 void copyf(char *file1, char *file2) {
-  int fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+  int fd;
 
-  stream = fopen(file1, "r");
-  if (stream == NULL) {
+  fd = open(file1, O_RDONLY);
+  if (fd == -1) {
     perror("Abrindo arquivo real para cópia (leitura)");
     return;
   }
-
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fclose(stream);
-    return;
-  }
-
-  while ((read = fread(buffer, sizeof(char), COPY_BUFFER_SIZE, stream)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      fclose(stream);
-      fs_close(fd2);
-      return;
-    }
-  }
-
-  fclose(stream);
-  fs_close(fd2);
+  fs_import(fd, file2);
+  close(fd);
 }
 
 void copyt(char *file1, char *file2) {
-  int fd1;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
-
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
-    return;
-  }
+  int fd;
 
-  stream = fopen(file2, "w+");
-  if (stream == NULL) {
+  fd = open(file2, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
     perror("Abrindo arquivo real para cópia (escrita)");
-    fs_close(fd1);
     return;
   }
+  fs_export(file1, fd);
+  close(fd);
+}
+
+void stats() {
+  char *nomes[FS_NUM_OPS] = { "init", "format", "list", "create", "remove",
+                              "open", "close", "write", "read", "seek",
+                              "sync", "import", "export", "clone" };
+  fs_estatisticas e;
 
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fwrite(buffer, sizeof(char), read, stream) != read) {
-      perror("Escrevendo arquivo real");
-      fs_close(fd1);
-      fclose(stream);
-      return;
+  fs_stats(&e);
+  printf("Disco: %ld setores lidos, %ld escritos, %ld descartados, %ld syncs, %ld requisições assíncronas.\n",
+         e.setores_lidos, e.setores_escritos, e.setores_descartados, e.syncs,
+         e.reqs_assincronas);
+  printf("Cache: %ld acertos, %ld faltas.\n", e.cache_acertos, e.cache_faltas);
+  printf("FAT: %ld entradas varridas, %ld páginas lidas. Cadeias: %ld passos. Diretório: %ld sondagens.\n",
+         e.fat_varridas, e.fat_paginas_lidas, e.saltos_cadeia, e.sondagens_dir);
+  printf("Leitura antecipada: %ld bytes, %ld acertos.\n", e.bytes_antecipados,
+         e.antecipa_acertos);
+  printf("Somas: %ld setores conferidos, %ld errados.\n", e.somas_conferidas,
+         e.somas_erradas);
+  printf("Operação  Qtde      Média (us)  Latências (us)\n");
+  for (int op = 0; op < FS_NUM_OPS; op++) {
+    if (e.ops[op] == 0) {
+      continue;
+    }
+    printf("%-9s %-9ld %-11.1f", nomes[op], e.ops[op],
+           e.tempo_ns[op] / 1000.0 / e.ops[op]);
+    for (int f = 0; f < FS_HIST_FAIXAS; f++) {
+      if (e.hist[op][f] == 0) {
+        continue;
+      }
+      if (f == FS_HIST_FAIXAS - 1) {
+        printf(" >=%ld:%ld", 1L << (f - 1), e.hist[op][f]);
+      } else {
+        printf(" <%ld:%ld", 1L << f, e.hist[op][f]);
+      }
     }
+    printf("\n");
   }
-
-  fs_close(fd1);
-  fclose(stream);
 }
@@ -0,0 +1,203 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Testes de regressao do RSFS. Cada teste monta uma imagem nova, confere o
+ * que le contra o que escreveu e relata OK ou FALHOU; o programa termina
+ * com 1 se algum teste falhou. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define TAMANHO_IMAGEM (32 * 2048)  /* 32 MB, em setores */
+
+char *imagem;
+int falhas;
+
+static void prepara_disco() {
+  unlink(imagem);
+  if (!bl_init(imagem, TAMANHO_IMAGEM) || !fs_format()) {
+    fprintf(stderr, "Erro preparando a imagem %s\n", imagem);
+    exit(1);
+  }
+}
+
+static void relata(char *nome, int ok) {
+  printf("%-30s %s\n", nome, ok ? "OK" : "FALHOU");
+  if (!ok) {
+    falhas++;
+  }
+}
+
+/* Leitura sequencial em pedacos pequenos, que passa pela leitura
+ * antecipada, de um arquivo que cresce por outro descritor entre as
+ * leituras. O arquivo comeca com um setor pela metade no disco, de onde a
+ * janela seguinte tem de partir. */
+static void teste_antecipa_acrescimo() {
+  int total = 1000 + 200000 * 3;
+  char *dados = malloc(total);
+  char lido[100];
+  int escrito, pos, ok;
+  int w, r;
+
+  for (int i = 0; i < total; i++) {
+    dados[i] = i * 7 + i / 251;
+  }
+  prepara_disco();
+  ok = fs_create("a");
+  w = fs_open("a", FS_W);
+  ok = ok && w != -1 && fs_write(dados, 1000, w) == 1000 && fs_close(w);
+  escrito = 1000;
+
+  r = fs_open("a", FS_R);
+  w = fs_open("a", FS_W);
+  ok = ok && r != -1 && w != -1;
+  pos = 0;
+  while (ok && pos < total) {
+    int n = fs_read(lido, sizeof(lido), r);
+    ok = n > 0 && !memcmp(lido, dados + pos, n);
+    pos += n;
+    if (ok && pos == 100 && escrito < total) {
+      ok = fs_write(dados + escrito, 200000, w) == 200000;
+      escrito += 200000;
+    }
+    if (ok && pos == escrito && escrito < total) {
+      ok = fs_write(dados + escrito, 200000, w) == 200000;
+      escrito += 200000;
+    }
+  }
+  ok = ok && fs_close(r) && fs_close(w);
+  relata("antecipa_acrescimo", ok);
+  free(dados);
+}
+
+/* Operacoes seguidas de um periodo ocioso: o journal as confirma no prazo
+ * sem fs_sync. Um processo filho, que nao herda o cache do pai, monta a
+ * imagem como ela esta no disco depois do prazo. */
+static void teste_confirma_ocioso() {
+  char dados[3000];
+  char lido[4000];
+  int ok, f, estado;
+  pid_t filho;
+
+  for (int i = 0; i < (int) sizeof(dados); i++) {
+    dados[i] = i * 13 + 5;
+  }
+  prepara_disco();
+  fs_journal_config(20);
+  ok = fs_create("b");
+  f = fs_open("b", FS_W);
+  ok = ok && f != -1 && fs_write(dados, sizeof(dados), f) == sizeof(dados) && fs_close(f);
+  usleep(300000);
+
+  filho = ok ? fork() : -1;
+  if (filho == 0) {
+    ok = bl_init(imagem, 0) && fs_init() == FS_MONTADO;
+    f = ok ? fs_open("b", FS_R) : -1;
+    ok = f != -1 && fs_read(lido, sizeof(lido), f) == sizeof(dados) &&
+         !memcmp(lido, dados, sizeof(dados));
+    _exit(!ok);
+  }
+  ok = filho != -1 && waitpid(filho, &estado, 0) == filho &&
+       WIFEXITED(estado) && WEXITSTATUS(estado) == 0;
+  relata("confirma_ocioso", ok);
+}
+
+/* Setor estragado no disco depois de lido e conferido: a montagem seguinte
+ * comeca sem as marcas de setor conferido e a leitura acusa a soma errada */
+static void teste_somas_remontagem() {
+  char marca[] = "MARCA-DAS-SOMAS";
+  int total = 200000;
+  char *dados = malloc(total);
+  char *lido = malloc(total);
+  char *img = NULL;
+  long tam = 0;
+  char *achado = NULL;
+  int ok, f, fd;
+
+  for (int i = 0; i < total; i++) {
+    dados[i] = i * 31 + 3;
+  }
+  memcpy(dados + 100000, marca, sizeof(marca));
+  fs_somas_config(1);
+  prepara_disco();
+  fs_somas_config(0);
+  ok = fs_create("c");
+  f = fs_open("c", FS_W);
+  ok = ok && f != -1 && fs_write(dados, total, f) == total && fs_close(f);
+  f = fs_open("c", FS_R);
+  ok = ok && f != -1 && fs_read(lido, total, f) == total && fs_close(f) && fs_sync();
+
+  /* Troca um byte do marcador direto na imagem */
+  fd = open(imagem, O_RDWR);
+  if (ok && fd != -1) {
+    tam = lseek(fd, 0, SEEK_END);
+    img = malloc(tam);
+    if (pread(fd, img, tam, 0) != tam) {
+      tam = 0;
+    }
+    for (long i = 0; i + (long) sizeof(marca) <= tam; i++) {
+      if (!memcmp(img + i, marca, sizeof(marca))) {
+        achado = img + i;
+        break;
+      }
+    }
+  }
+  ok = ok && achado != NULL;
+  if (ok) {
+    char estragado = achado[4] ^ 0x40;
+    ok = pwrite(fd, &estragado, 1, achado - img + 4) == 1;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+
+  ok = ok && bl_init(imagem, 0) && fs_init() == FS_MONTADO;
+  f = ok ? fs_open("c", FS_R) : -1;
+  ok = f != -1 && fs_read(lido, total, f) == -1 && fs_close(f);
+  relata("somas_remontagem", ok);
+  free(img);
+  free(dados);
+  free(lido);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("Uso: %s imagem\n", argv[0]);
+    printf("Onde: imagem e o arquivo de imagem usado (e apagado) pelos testes.\n");
+    return 1;
+  }
+  imagem = argv[1];
+
+  teste_antecipa_acrescimo();
+  teste_confirma_ocioso();
+  teste_somas_remontagem();
+
+  unlink(imagem);
+  return falhas != 0;
+}